@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include "trace.h"
+#include "diskio.h"
+#include "asyncio.h"
+
+#define trace trace_off
+
+/*
+ * Two backends behind one interface.  Native Linux AIO is preferred: the
+ * snapshot devices are opened O_DIRECT, which is what the kernel needs to
+ * really do the io asynchronously.  If the kernel can't give us an aio
+ * context we fall back to a small pool of threads doing ordinary blocking
+ * io.  Either way completions are signalled through an eventfd and the
+ * callbacks run in whoever calls async_reap(), so the caller never has to
+ * think about locking.
+ */
+
+static int eventfd_ = -1, use_threads;
+static unsigned depth_;
+
+/* Native Linux AIO */
+
+static aio_context_t context;
+
+static int submit_aio(struct async_io *io)
+{
+	struct iocb iocb = {
+		.aio_data = (uintptr_t)io,
+		.aio_lio_opcode = io->write? IOCB_CMD_PWRITE: IOCB_CMD_PREAD,
+		.aio_fildes = io->fd,
+		.aio_buf = (uintptr_t)io->data,
+		.aio_nbytes = io->count,
+		.aio_offset = io->offset,
+		.aio_flags = IOCB_FLAG_RESFD,
+		.aio_resfd = eventfd_ };
+	struct iocb *list[1] = { &iocb };
+
+	while (1) {
+		int ret = syscall(__NR_io_submit, context, 1, list);
+		if (ret == 1)
+			return 0;
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		return ret < 0? -errno: -EIO;
+	}
+}
+
+static int reap_aio(struct async_io **done)
+{
+	struct io_event events[depth_];
+	struct timespec nowait = { };
+	int count = 0;
+
+	while (1) {
+		int ret = syscall(__NR_io_getevents, context, 0, depth_, events, &nowait);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return count;
+		for (int i = 0; i < ret; i++) {
+			struct async_io *io = (struct async_io *)(uintptr_t)events[i].data;
+			long res = events[i].res;
+			io->result = res < 0? res: res == io->count? 0: -EIO;
+			io->next = *done;
+			*done = io;
+		}
+		count += ret;
+	}
+}
+
+/* Thread pool fallback */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static struct async_io *queue, **queue_tail = &queue, *completed;
+static pthread_t *threads_;
+static int stopping;
+
+static void *worker(void *unused)
+{
+	while (1) {
+		pthread_mutex_lock(&lock);
+		while (!queue && !stopping)
+			pthread_cond_wait(&work, &lock);
+		if (stopping) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		struct async_io *io = queue;
+		if (!(queue = io->next))
+			queue_tail = &queue;
+		pthread_mutex_unlock(&lock);
+
+		io->result = io->write?
+			diskwrite(io->fd, io->data, io->count, io->offset):
+			diskread(io->fd, io->data, io->count, io->offset);
+
+		pthread_mutex_lock(&lock);
+		io->next = completed;
+		completed = io;
+		pthread_mutex_unlock(&lock);
+		if (write(eventfd_, &(uint64_t){ 1 }, sizeof(uint64_t)) < 0)
+			warn("unable to signal io completion: %s", strerror(errno));
+	}
+}
+
+static int submit_thread(struct async_io *io)
+{
+	pthread_mutex_lock(&lock);
+	io->next = NULL;
+	*queue_tail = io;
+	queue_tail = &io->next;
+	pthread_cond_signal(&work);
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+static int reap_thread(struct async_io **done)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&lock);
+	while (completed) {
+		struct async_io *io = completed;
+		completed = io->next;
+		io->next = *done;
+		*done = io;
+		count++;
+	}
+	pthread_mutex_unlock(&lock);
+	return count;
+}
+
+/*
+ * Set up for up to depth ios in flight.  Returns a file descriptor that
+ * polls readable when there may be completions to reap, or -errno.
+ */
+int async_start(unsigned depth, int threads)
+{
+	if ((eventfd_ = eventfd(0, EFD_NONBLOCK)) < 0)
+		return -errno;
+	depth_ = depth;
+
+	if (!threads && !syscall(__NR_io_setup, depth, &context)) {
+		trace_on(warn("using native aio for %u ios", depth););
+		return eventfd_;
+	}
+	if (!threads)
+		warn("native aio not available (%s), using %u io threads", strerror(errno), depth);
+
+	use_threads = 1;
+	if (!(threads_ = calloc(depth, sizeof(pthread_t))))
+		return -ENOMEM;
+	for (int i = 0; i < depth; i++) {
+		int err = pthread_create(&threads_[i], NULL, worker, NULL);
+		if (err) {
+			warn("unable to start io thread: %s", strerror(err));
+			depth_ = i;
+			async_stop();
+			return -err;
+		}
+	}
+	return eventfd_;
+}
+
+int async_submit(struct async_io *io)
+{
+	trace(warn("%s %zu bytes at %Lx", io->write? "write": "read", io->count, (long long)io->offset););
+	return use_threads? submit_thread(io): submit_aio(io);
+}
+
+/*
+ * Run the callbacks of completed ios, waiting for at least one to complete
+ * first if asked.  Callbacks may submit more io.  Returns the number reaped.
+ */
+int async_reap(int wait)
+{
+	struct async_io *done = NULL;
+	uint64_t events;
+	int count;
+
+	while (1) {
+		if (read(eventfd_, &events, sizeof(events)) < 0 && errno != EAGAIN)
+			warn("unable to read io completion events: %s", strerror(errno));
+		count = use_threads? reap_thread(&done): reap_aio(&done);
+		if (count || !wait)
+			break;
+		poll(&(struct pollfd){ .fd = eventfd_, .events = POLLIN }, 1, -1);
+	}
+
+	/* completions come back newest first, run them in order */
+	struct async_io *list = NULL;
+	while (done) {
+		struct async_io *next = done->next;
+		done->next = list;
+		list = done;
+		done = next;
+	}
+	while (list) {
+		struct async_io *next = list->next;
+		list->done(list);
+		list = next;
+	}
+	return count;
+}
+
+void async_stop(void)
+{
+	if (use_threads) {
+		pthread_mutex_lock(&lock);
+		stopping = 1;
+		pthread_cond_broadcast(&work);
+		pthread_mutex_unlock(&lock);
+		for (int i = 0; i < depth_; i++)
+			pthread_join(threads_[i], NULL);
+		free(threads_);
+	} else
+		syscall(__NR_io_destroy, context);
+	close(eventfd_);
+	eventfd_ = -1;
+}
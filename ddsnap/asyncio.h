@@ -0,0 +1,30 @@
+#ifndef __DDSNAP_ASYNCIO_H
+#define __DDSNAP_ASYNCIO_H
+
+#include <sys/types.h>
+
+/*
+ * Asynchronous disk io: submit reads and writes, learn about completions by
+ * polling the file descriptor returned from async_start(), then call
+ * async_reap() to run the completion callbacks in the caller's thread.
+ */
+
+struct async_io
+{
+	int fd;
+	int write;
+	void *data;
+	size_t count;
+	off_t offset;
+	int result; /* zero or -errno on completion */
+	void (*done)(struct async_io *io);
+	void *private;
+	struct async_io *next; /* thread pool queues */
+};
+
+int async_start(unsigned depth, int threads);
+int async_submit(struct async_io *io);
+int async_reap(int wait);
+void async_stop(void);
+
+#endif // __DDSNAP_ASYNCIO_H
@@ -1,10 +1,12 @@
 #define _XOPEN_SOURCE 600 /* pwrite >=500(?), posix_memalign needs >= 600*/
+#define _GNU_SOURCE /* MAP_ANONYMOUS, MAP_HUGETLB */
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "list.h"
 #include "diskio.h"
 #include "buffer.h"
@@ -31,20 +33,50 @@
  * going to be a whole lot easier.  Most higher level code will not need
  * to be modified at all.  Another benefit is, it will be much easier to
  * add async IO.
+ *
+ * The buffer heads live in one array, sized for the whole cache when the
+ * cache is set up, and are handed out in order as the cache fills.  Cached
+ * buffers are found through a hash table that doubles whenever it holds
+ * more buffers than buckets.
+ *
+ * Once every head is in use a miss replaces a cached buffer, chosen 2Q
+ * fashion so that one pass over the whole btree can't flush the blocks
+ * the I/O path keeps coming back to.  A buffer read for the first time goes
+ * on the probation queue, which is replaced first in first out once it
+ * holds more than a quarter of the cache.  A buffer that was hit while on
+ * probation, or that is read again soon after being replaced from there,
+ * moves to the protected queue, which is replaced by the clock algorithm:
+ * a buffer hit since the hand last passed gets another turn.  We remember
+ * recently replaced probation buffers by sector alone, in the ghost table.
+ *
+ * Callers mark their full tree traversals with buffer_scan().  Buffers a
+ * scan reads stay on probation, are replaced before anything else, and
+ * are not remembered in the ghost table.  Callers move btree index nodes
+ * straight to the protected queue with protect_buffer(), or keep them for
+ * good by holding a reference, since a busy buffer is never replaced.
  */
-struct list_head lru_buffers;
-struct list_head free_buffers;
-
-static struct buffer *buffer_table[BUFFER_BUCKETS];
+static struct buffer *buffers; /* all the buffer heads */
+static unsigned buffers_used; /* heads handed out so far */
+static struct buffer *free_list;
+static LIST_HEAD(probation);
+static LIST_HEAD(protected);
+static unsigned probation_count, protected_count, max_probation;
+static sector_t *ghost_table; /* sector + 1 of replaced buffers, or zero */
+static unsigned ghost_bits;
+static int scanning;
+static void *buffer_pool; /* preallocated buffer data, mapped */
+static size_t buffer_pool_size;
+static int poison_buffers;
+
+static struct buffer **buffer_table;
+static unsigned hash_bits;
 LIST_HEAD(dirty_buffers);
 unsigned dirty_buffer_count;
-LIST_HEAD(lru_buffers);
-unsigned buffer_count;
-LIST_HEAD(free_buffers);
+unsigned buffer_count; /* buffers in the hash table */
 unsigned journaled_count;
 LIST_HEAD(journaled_buffers); /* bufferes that have been written to journal but not yet to snapstore */
-static unsigned max_buffers = 10000;
-static unsigned max_evict = 1000; /* free 10 percent of the buffers */
+unsigned max_buffers = 10000;
+struct buffer_stats buffer_stats;
 
 void show_buffer(struct buffer *buffer)
 {
@@ -57,7 +89,7 @@ void show_buffers_(int all)
 {
 	unsigned i;
 
-	for (i = 0; i < BUFFER_BUCKETS; i++)
+	for (i = 0; buffer_table && i < 1U << hash_bits; i++)
 	{
 		struct buffer *buffer = buffer_table[i];
 
@@ -84,6 +116,13 @@ void show_buffers(void)
 	show_buffers_(1);
 }
 
+void show_buffer_stats(void)
+{
+	warn("%Lu hits, %Lu misses, %Lu evictions, %Lu ghost hits, %Lu read ahead, %u of %u buffers cached (%u protected), %u hash buckets",
+		buffer_stats.hits, buffer_stats.misses, buffer_stats.evictions, buffer_stats.ghost_hits, buffer_stats.readahead,
+		buffer_count, max_buffers, protected_count, buffer_table? 1U << hash_bits: 0);
+}
+
 void show_dirty_buffers(void)
 {
 	struct list_head *list;
@@ -192,6 +231,75 @@ int write_buffer(struct buffer *buffer)
 	return err;
 }
 
+/*
+ * Write a run of buffers to consecutive sectors starting at the given one,
+ * WRITE_IOVS buffers per vectored write.  All the buffers must be on the
+ * same device.
+ */
+#define WRITE_IOVS 64
+
+int write_buffers_to(struct buffer **buffers, unsigned count, sector_t sector)
+{
+	if (!count)
+		return 0;
+
+	struct iovec iov[WRITE_IOVS];
+	unsigned i, n;
+	int err;
+
+	for (; count; buffers += n, count -= n) {
+		n = count < WRITE_IOVS? count: WRITE_IOVS;
+		for (i = 0; i < n; i++) {
+			assert(buffers[i]->fd == buffers[0]->fd);
+			iov[i] = (struct iovec){ .iov_base = buffers[i]->data, .iov_len = buffers[i]->size };
+		}
+		if ((err = diskwritev(buffers[0]->fd, iov, n, sector << SECTOR_BITS)))
+			return err;
+		for (i = 0; i < n; i++)
+			sector += buffers[i]->size >> SECTOR_BITS;
+	}
+	return 0;
+}
+
+static int compare_buffers(const void *a, const void *b)
+{
+	struct buffer *buffer1 = *(struct buffer **)a, *buffer2 = *(struct buffer **)b;
+
+	if (buffer1->fd != buffer2->fd)
+		return buffer1->fd < buffer2->fd? -1: 1;
+	if (buffer1->sector != buffer2->sector)
+		return buffer1->sector < buffer2->sector? -1: 1;
+	return 0;
+}
+
+/*
+ * Write buffers back to their own locations in sector order, one vectored
+ * write for each run of adjacent buffers.  The array is sorted in place and
+ * each buffer written becomes clean.
+ */
+int write_buffers(struct buffer **buffers, unsigned count)
+{
+	unsigned i, j, k;
+	int err = 0;
+
+	qsort(buffers, count, sizeof(*buffers), compare_buffers);
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count; j++)
+			if (buffers[j]->fd != buffers[i]->fd ||
+			    buffers[j]->sector != buffers[j - 1]->sector + (buffers[j - 1]->size >> SECTOR_BITS))
+				break;
+		buftrace(warn("write %u buffers at %Lx", j - i, buffers[i]->sector););
+		int ret = write_buffers_to(buffers + i, j - i, buffers[i]->sector);
+		if (ret) {
+			err = ret;
+			continue;
+		}
+		for (k = i; k < j; k++)
+			set_buffer_uptodate(buffers[k]);
+	}
+	return err;
+}
+
 int read_buffer(struct buffer *buffer)
 {
 	buftrace(warn("read buffer %Lx", buffer->sector););
@@ -204,19 +312,45 @@ int read_buffer(struct buffer *buffer)
 
 unsigned buffer_hash(sector_t sector)
 {
-	return (((sector >> 32) ^ (sector_t)sector) * 978317583) % BUFFER_BUCKETS;
+	return (sector * 0x9e37fffffffc0001ULL) >> (64 - hash_bits);
 }
 
-static void add_buffer_lru(struct buffer *buffer)
+/*
+ * Double the hash table and rehash every buffer into it.  If we can't get
+ * the memory we just carry on with longer chains.
+ */
+static void grow_hash(void)
 {
-	buffer_count++;
-	list_add_tail(&buffer->list, &lru_buffers);
+	struct buffer **old = buffer_table;
+	unsigned i, buckets = 1 << hash_bits;
+
+	if (!(buffer_table = calloc(buckets * 2, sizeof(*buffer_table)))) {
+		buffer_table = old;
+		return;
+	}
+	hash_bits++;
+	for (i = 0; i < buckets; i++) {
+		struct buffer *buffer, *next;
+		for (buffer = old[i]; buffer; buffer = next) {
+			struct buffer **bucket = buffer_table + buffer_hash(buffer->sector);
+			next = buffer->hashlist;
+			buffer->hashlist = *bucket;
+			*bucket = buffer;
+		}
+	}
+	free(old);
+	buftrace(warn("hash table now has %u buckets", 1 << hash_bits););
 }
 
-static void remove_buffer_lru(struct buffer *buffer)
+static void add_buffer_hash(struct buffer *buffer)
 {
-	buffer_count--;
-	list_del(&buffer->list);
+	struct buffer **bucket;
+
+	if (++buffer_count > 1U << hash_bits)
+		grow_hash();
+	bucket = buffer_table + buffer_hash(buffer->sector);
+	buffer->hashlist = *bucket;
+	*bucket = buffer;
 }
 
 static struct buffer *remove_buffer_hash(struct buffer *buffer)
@@ -230,6 +364,7 @@ static struct buffer *remove_buffer_hash(struct buffer *buffer)
 removed:
 	*pbuffer = buffer->hashlist;
 	buffer->hashlist = NULL;
+	buffer_count--;
 	return buffer;
 }
 
@@ -237,84 +372,193 @@ static void add_buffer_free(struct buffer *buffer)
 {
 	assert(buffer->state == BUFFER_STATE_CLEAN || buffer->state == BUFFER_STATE_INVAL);
 	buffer->state = BUFFER_STATE_INVAL;
-	list_add_tail(&buffer->list, &free_buffers);
+	buffer->hashlist = free_list;
+	free_list = buffer;
 }
 
 static struct buffer *remove_buffer_free(void)
 {
-	struct buffer *buffer = NULL;
-	if (!list_empty(&free_buffers)) {
-		buffer = list_entry(free_buffers.next, struct buffer, list);
-		list_del(&buffer->list);
+	struct buffer *buffer = free_list;
+	if (buffer) {
+		free_list = buffer->hashlist;
+		buffer->hashlist = NULL;
 	}
 	return buffer;
 }
 
-struct buffer *new_buffer(sector_t sector, unsigned size)
+/* Hand out the next unused buffer head, with its data */
+static struct buffer *alloc_buffer(unsigned size)
 {
-	buftrace(printf("Allocate buffer, sector = %Lx\n", sector);)
-	struct buffer *buffer = NULL;
-	int min_buffers = 100, err;
+	struct buffer *buffer;
+	unsigned char *data;
+	int err;
 
-	if (max_buffers < min_buffers)
-		max_buffers = min_buffers;
+	if (buffers_used == max_buffers)
+		return NULL;
+	buftrace(warn("expand buffer pool"););
+	if ((err = posix_memalign((void **)&data, SECTOR_SIZE, size))) {
+		warn("Error: %s unable to expand buffer pool", strerror(err));
+		return NULL;
+	}
+	if (poison_buffers)
+		memset(data, 0xdd, size);
+	buffer = buffers + buffers_used++;
+	*buffer = (struct buffer){ .state = BUFFER_STATE_INVAL, .data = data };
+	return buffer;
+}
 
-	/* check if we hit the MAX_BUFFER limit and if there are any free buffers avail */
-	if ((buffer = remove_buffer_free()))
-		goto have_buffer;
+static void add_buffer_queue(struct buffer *buffer, unsigned queue)
+{
+	buffer->queue = queue;
+	if (queue == BUFFER_PROTECTED) {
+		list_add_tail(&buffer->list, &protected);
+		protected_count++;
+	} else {
+		list_add_tail(&buffer->list, &probation);
+		probation_count++;
+	}
+}
 
-	if (buffer_count < max_buffers)
-		goto alloc_buffer;
+static void remove_buffer_queue(struct buffer *buffer)
+{
+	list_del(&buffer->list);
+	if (buffer->queue == BUFFER_PROTECTED)
+		protected_count--;
+	else
+		probation_count--;
+	buffer->queue = 0;
+}
 
-	buftrace(printf("try to evict buffers\n");)
-	struct list_head *list, *safe;
-	int count = 0;
+static sector_t *ghost_slot(sector_t sector)
+{
+	return ghost_table + ((sector * 0x9e37fffffffc0001ULL) >> (64 - ghost_bits));
+}
 
-	list_for_each_safe(list, safe, &lru_buffers) {
-		struct buffer *buffer_evict = list_entry(list, struct buffer, list);
-		if (buffer_evict->count == 0 && !buffer_dirty(buffer_evict) && !buffer_journaled(buffer_evict)) {
-			remove_buffer_lru(buffer_evict);
-			remove_buffer_hash(buffer_evict);
-			add_buffer_free(buffer_evict);
-			if (++count == max_evict)
-				break;
-		}
+/* Was this sector replaced from probation lately?  Forget it if so. */
+static int ghost_hit(sector_t sector)
+{
+	sector_t *slot = ghost_slot(sector);
+
+	if (*slot != sector + 1)
+		return 0;
+	*slot = 0;
+	buffer_stats.ghost_hits++;
+	return 1;
+}
+
+static int buffer_busy(struct buffer *buffer)
+{
+	return buffer->count || buffer_dirty(buffer) || buffer_journaled(buffer);
+}
+
+static struct buffer *replace_buffer(struct buffer *buffer)
+{
+	buftrace(warn("Evict buffer for %Lx", buffer->sector););
+	if (buffer->queue == BUFFER_PROBATION && !buffer->scan)
+		*ghost_slot(buffer->sector) = buffer->sector + 1;
+	remove_buffer_queue(buffer);
+	remove_buffer_hash(buffer);
+	buffer->state = BUFFER_STATE_INVAL;
+	buffer_stats.evictions++;
+	return buffer;
+}
+
+/*
+ * Replace the oldest idle buffer on probation.  One that was hit while
+ * there moves to the protected queue instead.
+ */
+static struct buffer *replace_probation(void)
+{
+	unsigned n = probation_count;
+
+	while (n--) {
+		struct buffer *buffer = list_entry(probation.next, struct buffer, list);
+		if (!buffer_busy(buffer) && !buffer->referenced)
+			return replace_buffer(buffer);
+		remove_buffer_queue(buffer);
+		add_buffer_queue(buffer, buffer->referenced? BUFFER_PROTECTED: BUFFER_PROBATION);
 	}
-	if ((buffer = remove_buffer_free()))
-		goto have_buffer;
+	return NULL;
+}
 
-alloc_buffer:
-	buftrace(warn("expand buffer pool");)
-	if (buffer_count == max_buffers) {
-		warn("Maximum buffer count exceeded (%i)", dirty_buffer_count);
-		return NULL;
+/*
+ * Replace a protected buffer by the clock algorithm.  Two turns of the hand
+ * clear every reference bit, so if we find nothing by then every buffer is
+ * in use, dirty or waiting on the journal.
+ */
+static struct buffer *replace_protected(void)
+{
+	unsigned n = 2 * protected_count;
+
+	while (n--) {
+		struct buffer *buffer = list_entry(protected.next, struct buffer, list);
+		if (!buffer_busy(buffer) && !buffer->referenced)
+			return replace_buffer(buffer);
+		buffer->referenced = 0;
+		list_del(&buffer->list);
+		list_add_tail(&buffer->list, &protected);
 	}
-	buffer = (struct buffer *)malloc(sizeof(struct buffer));
-	if (!buffer)
-		return NULL;
-	*buffer = (struct buffer){ .state = BUFFER_STATE_INVAL };
-	if ((err = posix_memalign((void **)&(buffer->data), SECTOR_SIZE, size))) {
-		warn("Error: %s unable to expand buffer pool", strerror(err));
-		free(buffer);
+	return NULL;
+}
+
+static struct buffer *evict_cached_buffer(void)
+{
+	struct buffer *buffer;
+
+	if (scanning || probation_count > max_probation || !protected_count)
+		return (buffer = replace_probation())? buffer: replace_protected();
+	return (buffer = replace_protected())? buffer: replace_probation();
+}
+
+struct buffer *new_buffer(sector_t sector, unsigned size)
+{
+	buftrace(printf("Allocate buffer, sector = %Lx\n", sector);)
+	struct buffer *buffer;
+
+	if (!(buffer = remove_buffer_free()) && !(buffer = alloc_buffer(size)) && !(buffer = evict_cached_buffer())) {
+		warn("Maximum buffer count exceeded (%i)", dirty_buffer_count);
 		return NULL;
 	}
-
-have_buffer:
 	buffer->size = size;
 	assert(!buffer->count);
 	assert(buffer->state == BUFFER_STATE_INVAL);
 	buffer->sector = sector;
+	buffer->referenced = 0;
+	buffer->scan = scanning;
 	buffer->count++;
-	add_buffer_lru(buffer);
+	add_buffer_queue(buffer, !scanning && ghost_hit(sector)? BUFFER_PROTECTED: BUFFER_PROBATION);
 	return buffer;
 }
 
+/* Keep this buffer out of the way of scans, for btree index nodes */
+void protect_buffer(struct buffer *buffer)
+{
+	if (buffer->queue == BUFFER_PROBATION) {
+		remove_buffer_queue(buffer);
+		add_buffer_queue(buffer, BUFFER_PROTECTED);
+	}
+	buffer->referenced = 1;
+	buffer->scan = 0;
+}
+
+/*
+ * Mark the buffers read from now on as part of a scan, or not.  Returns
+ * the previous setting, for the caller to restore.
+ */
+int buffer_scan(int scan)
+{
+	int was = scanning;
+	scanning = scan;
+	return was;
+}
+
 int count_buffer(void)
 {
-        struct list_head *list, *safe;
-        int count = 0;
-        list_for_each_safe(list, safe, &lru_buffers) {
-                struct buffer *buffer = list_entry(list, struct buffer, list);	
+	unsigned i;
+	int count = 0;
+
+	for (i = 0; i < buffers_used; i++) {
+		struct buffer *buffer = buffers + i;
 		if (!buffer->count)
 			continue;
 		trace_off(warn("buffer %Lx has non-zero count %d", (long long)buffer->sector, buffer->count););
@@ -323,23 +567,35 @@ int count_buffer(void)
 	return count;
 }
 
+static struct buffer *find_buffer(sector_t sector)
+{
+	struct buffer *buffer;
+
+	for (buffer = buffer_table[buffer_hash(sector)]; buffer; buffer = buffer->hashlist)
+		if (buffer->sector == sector)
+			break;
+	return buffer;
+}
+
 struct buffer *getblk(unsigned fd, sector_t sector, unsigned size)
 {
-	struct buffer **bucket = buffer_table + buffer_hash(sector), *buffer;
+	struct buffer *buffer;
 
-	for (buffer = *bucket; buffer; buffer = buffer->hashlist)
-		if (buffer->sector == sector) {
-			buftrace(warn("Found buffer for %Lx", sector););
-			buffer->count++;
-			list_del(&buffer->list);
-			list_add_tail(&buffer->list, &lru_buffers);
-			return buffer;
+	if ((buffer = find_buffer(sector))) {
+		buftrace(warn("Found buffer for %Lx", sector););
+		buffer->count++;
+		if (!scanning) {
+			buffer->referenced = 1;
+			buffer->scan = 0;
 		}
+		buffer_stats.hits++;
+		return buffer;
+	}
+	buffer_stats.misses++;
 	if (!(buffer = new_buffer(sector, size)))
 		return NULL;
 	buffer->fd = fd;
-	buffer->hashlist = *bucket;
-	*bucket = buffer;
+	add_buffer_hash(buffer);
 	return buffer;
 }
 
@@ -365,10 +621,78 @@ struct buffer *bread(unsigned fd, sector_t sector, unsigned size)
 	return buffer;
 }
 
+/*
+ * Read ahead: bring the given blocks into the cache with as few reads as we
+ * can, for a caller about to bread() them one at a time.  Blocks already
+ * cached are left alone.  The rest are read in sector order, one vectored
+ * read for each run of blocks no more than READAHEAD_GAP blocks apart, the
+ * blocks in the gaps being read into a scratch block and thrown away, since
+ * one longer read beats a seek.  This is only a hint: a block we could not
+ * get a buffer for or could not read is just read again by bread() later.
+ * Nothing is done if the first block is cached already, so a caller walking
+ * forward can call this before each block and read a batch each time it
+ * steps past the last one.  Returns the number of blocks read.
+ */
+int breadahead(unsigned fd, sector_t *sectors, unsigned count, unsigned size)
+{
+	struct buffer *vec[count];
+	unsigned i, j, n = 0, blocks = size >> SECTOR_BITS;
+	static unsigned char *scratch;
+	static unsigned scratch_size;
+	int done = 0;
+
+	if (!count || find_buffer(sectors[0]))
+		return 0;
+	for (i = 0; i < count; i++) {
+		struct buffer *buffer;
+		if (find_buffer(sectors[i]))
+			continue;
+		if (!(buffer = new_buffer(sectors[i], size)))
+			break;
+		buffer->fd = fd;
+		add_buffer_hash(buffer);
+		vec[n++] = buffer;
+	}
+	if (!n)
+		return 0;
+	if (scratch_size < size) {
+		free(scratch);
+		if (posix_memalign((void **)&scratch, SECTOR_SIZE, size))
+			scratch = NULL;
+		scratch_size = scratch? size: 0;
+	}
+	qsort(vec, n, sizeof(*vec), compare_buffers);
+	for (i = 0; i < n; i = j) {
+		unsigned gaps = 0, k;
+		for (j = i + 1; j < n; j++) {
+			sector_t gap = (vec[j]->sector - vec[j - 1]->sector) / blocks - 1;
+			if (vec[j]->fd != vec[i]->fd || vec[j]->sector < vec[j - 1]->sector + blocks ||
+			    (vec[j]->sector - vec[j - 1]->sector) % blocks || gap > (scratch? READAHEAD_GAP: 0))
+				break;
+			gaps += gap;
+		}
+		struct iovec iov[j - i + gaps], *v = iov;
+		for (k = i; k < j; k++) {
+			if (k > i)
+				for (sector_t s = vec[k - 1]->sector + blocks; s < vec[k]->sector; s += blocks)
+					*v++ = (struct iovec){ .iov_base = scratch, .iov_len = size };
+			*v++ = (struct iovec){ .iov_base = vec[k]->data, .iov_len = size };
+		}
+		buftrace(warn("read ahead %u buffers at %Lx, %u gap blocks", j - i, vec[i]->sector, gaps););
+		if (!diskreadv(vec[i]->fd, iov, v - iov, vec[i]->sector << SECTOR_BITS))
+			for (k = i; k < j; k++, done++)
+				set_buffer_uptodate(vec[k]);
+	}
+	for (i = 0; i < n; i++)
+		brelse(vec[i]);
+	buffer_stats.readahead += done;
+	return done;
+}
+
 void evict_buffer(struct buffer *buffer)
 {
-	remove_buffer_lru(buffer);
-        if (!remove_buffer_hash(buffer))
+	remove_buffer_queue(buffer);
+	if (!remove_buffer_hash(buffer))
 		warn("buffer not found in hashlist");
 	buftrace(warn("Evicted buffer for %Lx", buffer->sector););
 	add_buffer_free(buffer);
@@ -378,16 +702,18 @@ void evict_buffer(struct buffer *buffer)
 void evict_buffers(void)
 {
 	unsigned i;
-	for (i = 0; i < BUFFER_BUCKETS; i++)
-	{
-		struct buffer *buffer;
-		for (buffer = buffer_table[i]; buffer;) {
-			struct buffer *next = buffer->hashlist;
-			if (!buffer->count)
-				evict_buffer(buffer);
-			buffer = next;
+	for (i = 0; buffer_table && i < 1U << hash_bits; i++) {
+		struct buffer **pbuffer = buffer_table + i, *buffer;
+		while ((buffer = *pbuffer)) {
+			if (buffer->count) {
+				pbuffer = &buffer->hashlist;
+				continue;
+			}
+			*pbuffer = buffer->hashlist;
+			buffer_count--;
+			remove_buffer_queue(buffer);
+			add_buffer_free(buffer);
 		}
-		buffer_table[i] = NULL; /* all buffers have been freed in this bucket */
 	}
 }
 
@@ -408,33 +734,65 @@ int flush_buffers(void) // !!! should use lru list
 	return(err);
 }
 
+/*
+ * The preallocated pool is mapped rather than allocated and left untouched,
+ * so its pages are only faulted in as buffers are first used and a restart
+ * with a big cache does not wait to fault in all of it.  If the
+ * administrator has reserved enough huge pages we take those, otherwise we
+ * ask for transparent huge pages, either way to spare the TLB across a
+ * cache of gigabytes.  Unless poisoning for debug, the pool starts out zero.
+ */
+#define HUGE_PAGE_SIZE (2 << 20)
+
+static void *map_buffer_pool(size_t size)
+{
+	void *pool;
+
+#ifdef MAP_HUGETLB
+	size_t huge = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+	pool = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (pool != MAP_FAILED) {
+		buftrace(warn("buffer pool in huge pages"););
+		buffer_pool_size = huge;
+		return pool;
+	}
+#endif
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(pool, size, MADV_HUGEPAGE); /* only a hint */
+#endif
+	buffer_pool_size = size;
+	return pool;
+}
+
 int preallocate_buffers(unsigned bufsize) {
-	struct buffer *buffers = (struct buffer *)malloc(max_buffers*sizeof(struct buffer));
-	unsigned char *data_pool = NULL;
-	int i, error = -ENOMEM; /* if malloc fails */
+	size_t size = (size_t)max_buffers * bufsize;
+	unsigned char *data_pool;
+	int i, error;
 
-	buftrace(warn("Pre-allocating buffers..."););
-	if (!buffers)
-		goto buffers_allocation_failure;
 	buftrace(warn("Pre-allocating data for buffers..."););
-	if ((error = posix_memalign((void **)&data_pool, (1 << SECTOR_BITS), max_buffers*bufsize)))
+	if (!(data_pool = buffer_pool = map_buffer_pool(size))) {
+		error = errno;
 		goto data_allocation_failure;
+	}
 
-	/* let's clear out the buffer array and data and set to deadly data 0xdd */
-	memset(data_pool, 0xdd, max_buffers*bufsize);
+	/* set to deadly data 0xdd to catch use of data never read */
+	if (poison_buffers)
+		memset(data_pool, 0xdd, size);
 
-	for(i = 0; i < max_buffers; i++) {
-		buffers[i] = (struct buffer){ .data = (data_pool + i*bufsize), .state = BUFFER_STATE_INVAL };
+	for(i = max_buffers - 1; i >= 0; i--) {
+		buffers[i] = (struct buffer){ .data = (data_pool + (size_t)i*bufsize), .state = BUFFER_STATE_INVAL };
 		add_buffer_free(&buffers[i]);
 	}
+	buffers_used = max_buffers;
 
 	return 0; /* sucess on pre-allocation of buffers */
 
 data_allocation_failure:
 	/* go back to on demand allocation */
 	warn("Error: %s unable to allocate space for buffer data", strerror(error));
-	free(buffers);
-buffers_allocation_failure:
 	warn("Unable to pre-allocate buffers. Using on demand allocation for buffers");
 	return error;
 }
@@ -443,24 +801,50 @@ buffers_allocation_failure:
  * buffers. I use the term "roughly" since it doesn't take into
  * consideration the size of the buffer struct and the overhead for
  * posix_memalign(). From empirical tests, the additional memory
- * is negligible.
+ * is negligible.  Zero means the minimum cache, allocated on demand.
+ * Poison fills buffer data with a pattern before first use, for debug.
  */
 
-void init_buffers(unsigned bufsize, unsigned mem_pool_size)
+void init_buffers(unsigned bufsize, unsigned long long mem_pool_size, int poison)
 {
 	assert(bufsize);
-	memset(buffer_table, 0, sizeof(buffer_table));
+	poison_buffers = poison;
 	INIT_LIST_HEAD(&dirty_buffers);
 	dirty_buffer_count = 0;
-	INIT_LIST_HEAD(&lru_buffers);
 	buffer_count = 0;
-	INIT_LIST_HEAD(&free_buffers);
 	journaled_count = 0;
 	INIT_LIST_HEAD(&journaled_buffers);
+	buffer_stats = (struct buffer_stats){ };
 
 	/* calculate number of max buffers to a fixed size, independent of chunk size */
 	max_buffers = mem_pool_size / bufsize;
-	max_evict = max_buffers / 10;
-
-	preallocate_buffers(bufsize);
+	if (max_buffers < MIN_BUFFERS)
+		max_buffers = MIN_BUFFERS;
+	free(buffers);
+	if (buffer_pool) {
+		munmap(buffer_pool, buffer_pool_size);
+		buffer_pool = NULL;
+	}
+	if (!(buffers = calloc(max_buffers, sizeof(struct buffer))))
+		error("unable to allocate %u buffer heads", max_buffers);
+	buffers_used = 0;
+	free_list = NULL;
+	INIT_LIST_HEAD(&probation);
+	INIT_LIST_HEAD(&protected);
+	probation_count = protected_count = 0;
+	max_probation = max_buffers / 4;
+
+	free(ghost_table);
+	for (ghost_bits = 1; 1U << ghost_bits < max_buffers / 2; ghost_bits++)
+		;
+	if (!(ghost_table = calloc(1 << ghost_bits, sizeof(*ghost_table))))
+		error("unable to allocate buffer ghost table");
+
+	free(buffer_table);
+	hash_bits = 10;
+	if (!(buffer_table = calloc(1 << hash_bits, sizeof(*buffer_table))))
+		error("unable to allocate buffer hash table");
+
+	if (mem_pool_size)
+		preallocate_buffers(bufsize);
 }
@@ -8,7 +8,10 @@
 #define BUFFER_STATE_CLEAN 2
 #define BUFFER_STATE_DIRTY 3
 #define BUFFER_STATE_JOURNALED 4
-#define BUFFER_BUCKETS 9999
+#define MIN_BUFFERS 100
+#define BUFFER_PROBATION 1
+#define BUFFER_PROTECTED 2
+#define READAHEAD_GAP 4
 
 #include "list.h"
 
@@ -17,21 +20,31 @@ typedef unsigned long long offset_t;
 
 struct buffer
 {
-	struct buffer *hashlist;
+	struct buffer *hashlist; /* used for the hash chain and the free list */
 	struct list_head dirty_list;
-	struct list_head list; /* used for LRU list and the free list */
+	struct list_head list; /* probation or protected queue */
 	unsigned count; // should be atomic_t
 	unsigned state;
 	unsigned size;
+	unsigned queue:2; /* which of the above, zero when free */
+	unsigned referenced:1; /* set by a cache hit */
+	unsigned scan:1; /* read by a scan, not worth remembering */
 	sector_t sector;
 	unsigned char *data;
 	unsigned fd;
 };
 
+struct buffer_stats
+{
+	unsigned long long hits, misses, evictions, ghost_hits, readahead;
+};
+
 struct list_head dirty_buffers;
 extern unsigned dirty_buffer_count;
+extern unsigned max_buffers;
 struct list_head journaled_buffers;
 extern unsigned journaled_count;
+extern struct buffer_stats buffer_stats;
 
 void show_dirty_buffers(void);
 void set_buffer_dirty(struct buffer *buffer);
@@ -41,18 +54,24 @@ void brelse(struct buffer *buffer);
 void brelse_dirty(struct buffer *buffer);
 int write_buffer_to(struct buffer *buffer, offset_t pos);
 int write_buffer(struct buffer *buffer);
+int write_buffers_to(struct buffer **buffers, unsigned count, sector_t sector);
+int write_buffers(struct buffer **buffers, unsigned count);
 int read_buffer(struct buffer *buffer);
 unsigned buffer_hash(sector_t sector);
 struct buffer *new_buffer(sector_t sector, unsigned size);
 struct buffer *getblk(unsigned fd, sector_t sector, unsigned size);
 struct buffer *bread(unsigned fd, sector_t sector, unsigned size);
+int breadahead(unsigned fd, sector_t *sectors, unsigned count, unsigned size);
 void evict_buffer(struct buffer *buffer);
 void evict_buffers(void);
 int flush_buffers(void);
 void show_buffer(struct buffer *buffer);
 void show_active_buffers(void);
 void show_buffers(void);
-void init_buffers(unsigned bufsize, unsigned mem_pool_size);
+void show_buffer_stats(void);
+void init_buffers(unsigned bufsize, unsigned long long mem_pool_size, int poison);
+void protect_buffer(struct buffer *buffer);
+int buffer_scan(int scanning);
 void add_buffer_journaled(struct buffer *buffer);
 
 static inline int buffer_dirty(struct buffer *buffer)
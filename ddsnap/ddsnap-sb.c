@@ -25,7 +25,8 @@
 
 #define SB_MAGIC_070604 { 't', 'e', 's', 't', 0xdd, 0x07, 0x06, 0x04 }	/* 0.4 - 0.7 release sb magic */
 #define SB_MAGIC_080325 { 't', 'e', 's', 't', 0xdd, 0x08, 0x03, 0x25 }	/* 0.8 release sb magic */
-#define SB_MAGIC { 't', 'e', 's', 't',  0xdd, 0x07, 0x06, 0x04 }	/* date of latest incompatible sb format */
+#define SB_MAGIC_261016 { 't', 'e', 's', 't', 0xdd, 0x26, 0x10, 0x16 }	/* extent btree leaves */
+#define SB_MAGIC { 't', 'e', 's', 't',  0xdd, 0x26, 0x10, 0x16 }	/* date of latest incompatible sb format */
 
 struct allocspace_img {
 	sector_t bitmap_base;	/* Allocation bitmap starting sector. */
@@ -145,6 +146,23 @@ static int upgrade_06(int metadev, char *magic)
 	return err;
 }
 
+/*
+ * upgrade from 0.8 to extent btree leaves
+ *
+ * Leaf map entries now carry a run length in bits that were always zero,
+ * which reads as a run of one chunk, so existing leaves are valid as they
+ * stand.  The server joins them into longer runs as it rewrites them.
+ */
+static int upgrade_08(int metadev, char *magic)
+{
+	int err;
+	warn("upgrade to extent btree leaves, just overwrite the sb magic");
+	memcpy(magic, (char[])SB_MAGIC_261016, sizeof((char[])SB_MAGIC_261016));
+	if ((err = diskwrite(metadev, magic, sizeof((char[])SB_MAGIC_261016), SB_SECTORS << SECTOR_BITS)) < 0)
+		warn("Unable to write superblock: %s", strerror(errno));
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	typeof((char[])SB_MAGIC) magic;
@@ -173,8 +191,7 @@ int main(int argc, char *argv[])
 			} else
 				upgrade_06(metadev, magic);
 		} else if (!memcmp(magic, (char[])SB_MAGIC_080325, sizeof(magic))) {
-			printf("magic number is up to date, do nothing\n");
-			//upgrade_08(metadev, magic);
+			err = upgrade_08(metadev, magic);
 		} else {
 			printf("superblock magic %s not supported\n", magic);
 			err = -EINVAL;
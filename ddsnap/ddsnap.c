@@ -1498,6 +1498,60 @@ static int delete_snapshot(int sock, u32 snaptag)
 	return 0;
 }
 
+/*
+ * Several snapshots go in one message, so the server makes one tree pass
+ * and deletes all of them or none.  There are never more than MAX_SNAPSHOTS
+ * to list once duplicates are dropped, which keeps the message in maxbody.
+ */
+static int delete_snapshots(int sock, u32 *snaptags, unsigned count)
+{
+	unsigned i, j, unique = 0;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < unique; j++)
+			if (snaptags[j] == snaptags[i])
+				break;
+		if (j == unique)
+			snaptags[unique++] = snaptags[i];
+	}
+	count = unique;
+	if (count > MAX_SNAPSHOTS) {
+		fprintf(stderr, "can not delete %u snapshots, there are at most %u\n", count, MAX_SNAPSHOTS);
+		return 1;
+	}
+	if (count == 1)
+		return delete_snapshot(sock, snaptags[0]);
+	if ((err = outhead(sock, DELETE_SNAPSHOTS, sizeof(struct delete_snapshots) + count * sizeof(u32))) < 0 ||
+	    (err = writepipe(sock, &count, sizeof(u32))) < 0 ||
+	    (err = writepipe(sock, snaptags, count * sizeof(u32))) < 0) {
+		warn("unable to send delete snapshots message: %s", strerror(-err));
+		return 1;
+	}
+	if (get_reply(sock, "delete snapshots", DELETE_SNAPSHOT_OK, 0, NULL) != 0) {
+		errprint("delete snapshots");
+		return 1;
+	}
+	return 0;
+}
+
+static int compact_tree(int sock)
+{
+	int err;
+
+	if ((err = outbead(sock, COMPACT_TREE, struct { })) < 0) {
+		warn("unable to send compact tree message: %s", strerror(-err));
+		return 1;
+	}
+	struct compact_tree_ok reply;
+	if (get_reply(sock, "compact tree", COMPACT_TREE_OK, sizeof(reply), &reply) != 0) {
+		errprint("compact tree");
+		return 1;
+	}
+	printf("exception tree was %Lu blocks, now %Lu blocks\n", (llu_t)reply.before, (llu_t)reply.after);
+	return 0;
+}
+
 static int create_snapshot(int sock, u32 snaptag)
 {
 	int err;
@@ -1933,7 +1987,9 @@ static void mainUsage(void)
 	       "        agent             Start the snapshot agent\n"
 	       "        server            Start the snapshot server\n"
 	       "	create            Create a snapshot\n"
-	       "	delete            Delete a snapshot\n"
+	       "	delete            Delete one or more snapshots\n"
+	       "	compact           Rebuild the snapshot metadata packed\n"
+	       "	import            Load exceptions into an empty snapshot store\n"
 	       "	list              Return list of snapshots currently held\n"
 	       "	priority          Set the priority of a snapshot\n"
 	       "	usecount          Change the use count of a snapshot\n"
@@ -1999,7 +2055,7 @@ int main(int argc, char *argv[])
 		POPT_TABLEEND
 	};
 
-	int debug = 0, experimental = 0, nobg = 0;
+	int debug = 0, experimental = 0, nobg = 0, group_commit = -1, copyout_depth = 0;
 	char const *logfile = NULL;
 	char const *pidfile = NULL;
 	char const *progress_file = NULL;
@@ -2012,6 +2068,8 @@ int main(int argc, char *argv[])
 		{ "foreground", 'f', POPT_ARG_NONE, &nobg, 0, "run in foreground. daemonized by default.", NULL }, // !!! unusual semantics, we should be foreground by default, and optionally daemonize
 		{ "logfile", 'l', POPT_ARG_STRING, &logfile, 0, "use specified log file", NULL },
 		{ "cachesize", 'k', POPT_ARG_STRING, &cachesize_str, 0, "Buffer cache size (default = max(128M,1/4 sys RAM)", "size" },
+		{ "groupcommit", 'G', POPT_ARG_INT, &group_commit, 0, "Share journal commits between write requests arriving within this many microseconds (0 = same poll wakeup)", "usecs" },
+		{ "copyouts", 'a', POPT_ARG_INT, &copyout_depth, 0, "Copy out asynchronously, with up to this many copies in flight (default 0 = synchronous)", "count" },
 #ifdef DDSNAP_MEM_MONITOR
 		{ "mmonitor", 'm', POPT_ARG_INT, &mmon_interval, 0, "Memory monitor delay, seconds, zero to disable.", NULL },
 #endif
@@ -2078,7 +2136,7 @@ int main(int argc, char *argv[])
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
 		  "Create snapshot\n\t Function: Create a snapshot\n\t Usage: create <sockname> <snapshot>", NULL },
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
-		  "Delete snapshot\n\t Function: Delete a snapshot\n\t Usage: delete <sockname> <snapshot>", NULL },
+		  "Delete snapshot\n\t Function: Delete one or more snapshots in a single pass\n\t Usage: delete <sockname> <snapshot>...", NULL },
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
 		  "List snapshots\n\t Function: Return list of snapshots currently held\n\t Usage: list <sockname>", NULL },
 		{ NULL, '\0', POPT_ARG_INCLUDE_TABLE, &noOptions, 0,
@@ -2291,6 +2349,10 @@ int main(int argc, char *argv[])
 				exit(1);
 			}
 		}
+		if (bs_bits > MAX_BLOCK_BITS) {
+			fprintf(stderr, "Block size must be under 1M%s. Try 64k\n", bs_str? "": " (it defaults to the chunk size)");
+			exit(1);
+		}
 		trace_off(printf("js_bytes is %u, bs_bits is %u, and cs_bits is %u\n", js_bytes, bs_bits, cs_bits););
 		return init_snapstore(orgdev_, snapdev_, metadev_, bs_bits, cs_bits, js_bytes);
 	}
@@ -2451,12 +2513,13 @@ int main(int argc, char *argv[])
 
 		poptFreeContext(serverCon);
 
-		enum runflags flags = experimental * RUN_DEFER | debug * RUN_SELFCHECK;
+		enum runflags flags = experimental * RUN_DEFER | debug * RUN_SELFCHECK | (group_commit >= 0) * RUN_GROUP_COMMIT;
 
 		return start_server(
 			orgdev_, snapdev_, metadev_,
 			agent_sockname, server_sockname, logfile, pidfile,
-			nobg, cachesize_bytes, flags);
+			nobg, cachesize_bytes, flags, group_commit >= 0? group_commit: 0,
+			copyout_depth > 0? copyout_depth: 0);
 	}
 	if (strcmp(command, "create") == 0) {
 		if (argc != 4) {
@@ -2478,24 +2541,94 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 	if (strcmp(command, "delete") == 0) {
-		if (argc != 4) {
-			printf("Usage: %s delete <sockname> <snapshot>\n", argv[0]);
+		if (argc < 4) {
+			printf("Usage: %s delete <sockname> <snapshot>...\n", argv[0]);
 			return 1;
 		}
 
-		u32 snaptag;
+		unsigned count = argc - 3;
+		u32 snaptags[count];
 
-		if (parse_snaptag(argv[3], &snaptag) < 0) {
-			fprintf(stderr, "%s: invalid snapshot %s\n", argv[0], argv[3]);
-			return 1;
-		}
+		for (int i = 0; i < count; i++)
+			if (parse_snaptag(argv[3 + i], &snaptags[i]) < 0) {
+				fprintf(stderr, "%s: invalid snapshot %s\n", argv[0], argv[3 + i]);
+				return 1;
+			}
 
 		int sock = create_socket(argv[2]);
 
-		int ret = delete_snapshot(sock, snaptag);
+		int ret = delete_snapshots(sock, snaptags, count);
 		close(sock);
 		return ret;
 	}
+	if (strcmp(command, "compact") == 0) {
+		if (argc == 3) {
+			int sock = create_socket(argv[2]);
+			int ret = compact_tree(sock);
+			close(sock);
+			return ret;
+		}
+		if ((argc != 5 && argc != 6) || strcmp(argv[2], "--offline")) {
+			printf("Usage: %s compact <sockname>\n"
+			       "       %s compact --offline <dev/snapshot> <dev/origin> [dev/meta]\n", argv[0], argv[0]);
+			return 1;
+		}
+
+		char const *snapdev = argv[3], *origdev = argv[4], *metadev = argc == 6 ? argv[5] : NULL;
+		int orgdev_, snapdev_, metadev_;
+		u64 before, after;
+
+		if ((snapdev_ = open(snapdev, O_RDWR | O_DIRECT)) == -1)
+			error("Could not open snapshot store %s: %s", snapdev, strerror(errno));
+
+		if ((orgdev_ = open(origdev, O_RDONLY | O_DIRECT)) == -1)
+			error("Could not open origin volume %s: %s", origdev, strerror(errno));
+
+		metadev_ = snapdev_;
+
+		if (metadev && !is_same_device(snapdev, metadev) && (metadev_ = open(metadev, O_RDWR | O_DIRECT)) == -1)
+			error("Could not open meta volume %s: %s", metadev, strerror(errno));
+
+		if (compact_snapstore(orgdev_, snapdev_, metadev_, &before, &after) < 0) {
+			fprintf(stderr, "%s: unable to compact snapshot store\n", argv[0]);
+			return 1;
+		}
+		printf("exception tree was %Lu blocks, now %Lu blocks\n", (llu_t)before, (llu_t)after);
+		return 0;
+	}
+	if (strcmp(command, "import") == 0) {
+		if (argc != 5 && argc != 6) {
+			printf("Usage: %s import <tuplefile> <dev/snapshot> <dev/origin> [dev/meta]\n", argv[0]);
+			return 1;
+		}
+
+		char const *snapdev = argv[3], *origdev = argv[4], *metadev = argc == 6 ? argv[5] : NULL;
+		int orgdev_, snapdev_, metadev_;
+		FILE *tuples;
+		u64 count;
+
+		if (!(tuples = fopen(argv[2], "r")))
+			error("Could not open tuple file %s: %s", argv[2], strerror(errno));
+
+		if ((snapdev_ = open(snapdev, O_RDWR | O_DIRECT)) == -1)
+			error("Could not open snapshot store %s: %s", snapdev, strerror(errno));
+
+		if ((orgdev_ = open(origdev, O_RDONLY | O_DIRECT)) == -1)
+			error("Could not open origin volume %s: %s", origdev, strerror(errno));
+
+		metadev_ = snapdev_;
+
+		if (metadev && !is_same_device(snapdev, metadev) && (metadev_ = open(metadev, O_RDWR | O_DIRECT)) == -1)
+			error("Could not open meta volume %s: %s", metadev, strerror(errno));
+
+		if (import_snapstore(orgdev_, snapdev_, metadev_, tuples, &count) < 0) {
+			fprintf(stderr, "%s: unable to import exceptions from %s\n", argv[0], argv[2]);
+			return 1;
+		}
+		fclose(tuples);
+		printf("imported %Lu exceptions\n", (llu_t)count);
+		return 0;
+	}
 	if (strcmp(command, "list") == 0) {
 		if (argc != 3) {
 			printf("Usage: %s list <sockname>\n", argv[0]);
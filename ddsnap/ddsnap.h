@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -64,6 +65,7 @@ struct server { struct server_head { u8 type; u8 length; } header; char *address
 #endif
 
 #define MAX_SNAPSHOTS 64
+#define MAX_BLOCK_BITS 19 // leaf map offsets are 20 bits, so metadata blocks are under 1M
 #define SNAPSHOT_SQUASHED MAX_SNAPSHOTS
 
 struct change_list
@@ -82,7 +84,7 @@ extern struct change_list *init_change_list(u32 chunksize_bits, u32 src_snap, u3
 extern int append_change_list(struct change_list *cl, u64 chunkaddr);
 extern void free_change_list(struct change_list *cl);
 
-enum runflags { RUN_SB_DIRTY = 1, RUN_SELFCHECK = 2, RUN_DEFER = 4 };
+enum runflags { RUN_SB_DIRTY = 1, RUN_SELFCHECK = 2, RUN_DEFER = 4, RUN_GROUP_COMMIT = 8, RUN_ACTIVE = 16 };
 
 int sniff_snapstore(int metadev);
 
@@ -90,10 +92,17 @@ int init_snapstore(
 	int orgdev, int snapdev, int metadev,
 	unsigned bs_bits, unsigned cs_bits, unsigned js_bytes);
 
+int compact_snapstore(int orgdev, int snapdev, int metadev, u64 *before, u64 *after);
+
+/* What ddsnap import reads: little endian, sorted by origin chunk */
+struct exception_tuple { u64 chunk, exception, share; };
+
+int import_snapstore(int orgdev, int snapdev, int metadev, FILE *tuples, u64 *count);
+
 int start_server(
 	int orgdev, int snapdev, int metadev, 
 	char const *agent_sockname, char const *server_sockname, char const *logfile, char const *pidfile,
-	int nobg, uint64_t cachesize_bytes, enum runflags flags);
+	int nobg, uint64_t cachesize_bytes, enum runflags flags, unsigned commit_window, unsigned copyout_depth);
 
 /* start_server flags */
 
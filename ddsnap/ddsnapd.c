@@ -25,6 +25,7 @@
 #include <signal.h>
 #include <sys/mman.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -38,6 +39,8 @@
 #include "daemonize.h"
 #include "ddsnap.h"
 #include "diskio.h"
+#include "leafmap.h"
+#include "asyncio.h"
 #include "list.h"
 #include "sock.h"
 #include "trace.h"
@@ -49,13 +52,14 @@
 
 #define SB_SECTOR 8			/* Sector where superblock lives.     */
 #define SB_SECTORS 8			/* Size of ddsnap super block in sectors */
-#define SB_MAGIC { 't', 'e', 's', 't', 0xdd, 0x07, 0x06, 0x04 } /* date of latest incompatible sb format */
+#define SB_MAGIC { 't', 'e', 's', 't', 0xdd, 0x26, 0x10, 0x16 } /* date of latest incompatible sb format */
 /*
  * Snapshot store format revision history
  * !!! always update this for every incompatible change !!!
  *
  * 2007-04-05: SB magic added and enforced
  * 2007-06-04: SB journal commit block used fields replaced by free
+ * 2026-10-16: btree leaf map entries describe runs of chunks (extents)
  */
 
 #define DDSNAPD_CLIENT_ERROR -1
@@ -69,6 +73,9 @@
 #define PR_SET_LESS_THROTTLE 23
 #define PR_SET_MEMALLOC	24
 #define MAX_NEW_METACHUNKS 10
+#define EXTENT_SEARCH_BLOCKS 16
+#define READAHEAD_LEAVES 32
+#define DELETE_LEAVES 64 /* per background delete step while idle */
 #define MAX_DEFERRED_ALLOCS 500
 
 #ifndef trace
@@ -88,11 +95,11 @@ Todo:
 
 BTree
   * coalesce leafs/nodes for delete
-  - B*Tree splitting
+  + B*Tree splitting (leaves)
 
 Allocation bitmaps
   + allocation statistics
-  - Per-snapshot free space as full-tree pass
+  + Per-snapshot free space kept current, checkpointed at shutdown
   - option to track specific snapshot(s) on the fly
   \ return stats to client (on demand? always?)
   * Bitmap block radix tree - resizing
@@ -124,8 +131,8 @@ Snapshot handling path
   - try AIO
   \ coalesce leaves/nodes on delete
      - should wait for current queries on snap to complete
-  - background deletion optimization
-     - record current deletion list in superblock
+  + background deletion optimization
+     + record current deletion list in superblock
   - separate thread for copyouts
   - separate thread for buffer flushing
   - separate thread for new connections (?)
@@ -173,6 +180,18 @@ struct enode
 	} entries[];
 };
 
+/*
+ * Each leaf map entry covers a run of logical chunks starting at rchunk.
+ * Every chunk of a run has the same list of exceptions, with the same share
+ * masks, and the exception chunks recorded are those of the first chunk of
+ * the run: chunk rchunk + i is at exception chunk + i.  So a region copied
+ * out to contiguous exceptions takes one map entry, not one per chunk.  The
+ * run field is one less than the length, which makes the entries of leaves
+ * written before runs existed valid runs of one chunk.
+ */
+#define LEAF_VERSION 1
+#define MAX_LEAF_RUN (1 << 12)
+
 struct eleaf
 {
 	le_u16 magic;
@@ -180,12 +199,7 @@ struct eleaf
 	le_u32 count;
 	le_u64 base_chunk; // !!! FIXME the code doesn't use the base_chunk properly
 	le_u64 using_mask;
-	struct etree_map
-	{
-		le_u32 offset;
-		le_u32 rchunk;
-	}
-	map[];
+	struct etree_map map[]; // see leafmap.h
 };
 
 static inline struct enode *buffer2node(struct buffer *buffer)
@@ -209,7 +223,12 @@ static inline struct exception *emap(struct eleaf *leaf, unsigned i)
 	return	(struct exception *)((char *) leaf + leaf->map[i].offset);
 }
 
-enum sbflags { SB_BUSY = 2 };
+static inline unsigned run_chunks(struct eleaf *leaf, unsigned i)
+{
+	return leaf->map[i].run + 1;
+}
+
+enum sbflags { SB_BUSY = 2, SB_SHARING_BASE = 4, SB_SHARING = 8 };
 
 struct disksuper
 {
@@ -218,7 +237,7 @@ struct disksuper
 	sector_t etree_root;		/* The b-tree root node sector.       */
 	sector_t orgoffset, orgsectors;
 	u64 flags;
-	u64 deleting;
+	u64 deleting;			/* Snapshot bits still being deleted. */
 	struct snapshot
 	{
 		u32 ctime; // upper 32 bits are in super create_time
@@ -243,6 +262,64 @@ struct disksuper
 		u64      bitmap_blocks;	/* Num blocks in allocation bitmap.   */
 		u32      allocsize_bits; /* Bits of number of bytes in chunk. */
 	} metadata, snapdata;
+	sector_t sharing_base;		/* Sharing table checkpoint, if SB_SHARING_BASE. */
+	chunk_t delete_resume;		/* Next chunk to delete from, if deleting. */
+};
+
+/*
+ * Free space summary
+ *
+ * The allocator used to read bitmap blocks one after another until it found
+ * a clear bit, which on a nearly full volume means reading most of the
+ * bitmap for every allocation.  Instead we keep the number of clear bits in
+ * each bitmap block in memory, and above that the number of clear bits in
+ * each group of SUMMARY_GROUP blocks, so the allocator can step over full
+ * blocks and whole full groups without touching the bitmap.
+ *
+ * The summary counts bits, not free chunks: chunks held by deferred
+ * allocations are still clear in the bitmap and are counted here.  It is
+ * not saved to disk, but rebuilt from the bitmap when the server starts
+ * and after a resize, and kept current by change_bits(), free_chunk() and
+ * the allocator.  It lives in the superblock, not in struct allocspace,
+ * which is read and written along with the disk image.
+ */
+#define SUMMARY_GROUP_BITS 8
+#define SUMMARY_GROUP (1 << SUMMARY_GROUP_BITS)
+
+struct free_summary {
+	unsigned blocks, groups;	/* Bitmap blocks and groups covered.  */
+	u32 *block;			/* Clear bits per bitmap block.       */
+	u32 *group;			/* Clear bits per group of blocks.    */
+};
+
+/*
+ * Pinned index nodes
+ *
+ * Every probe walks the index nodes from the root down, so they are kept
+ * out of the buffer cache's replacement altogether: the node cache holds a
+ * reference on each index node buffer it has seen, in a small open hash by
+ * sector, and probes look there before going to the buffer cache.  Only
+ * so many nodes are pinned, a share of the cache.  When that is used up
+ * a node nearer the root takes the place of one nearer the leaves, so it
+ * is the upper levels that stay.  Height is counted up from the leaves,
+ * so that growing or shrinking the tree at the root leaves it alone.  A
+ * count of the nodes pinned at each height gives the lowest height without
+ * a search, and a clock hand goes on round the table from the last node
+ * given up to the next one at that height.
+ */
+#define MAX_ETREE_LEVELS 16
+
+struct pinned_node {
+	sector_t sector;
+	struct buffer *buffer;		/* Held, or NULL if the slot is empty. */
+	unsigned height;		/* Levels above the leaves.	      */
+};
+
+struct node_cache {
+	struct pinned_node *table;
+	unsigned bits, count, max;
+	unsigned hand; // where to look for the next node to give up
+	unsigned pinned[MAX_ETREE_LEVELS + 1]; // nodes pinned at each height
 };
 
 struct allocspace { // everything bogus here!!!
@@ -285,6 +362,20 @@ struct allocspace { // everything bogus here!!!
 
 struct alloc_range { u64 chunk; u32 barrier:1, count:31; u32 pad; };
 
+struct unique_set
+{
+	unsigned char **page;
+	unsigned *count; // chunks set in each page
+	unsigned pages, used;
+};
+
+/* Fixed size records carved out of slabs, see pool_alloc() */
+struct pool
+{
+	void *free; // linked through the first word of each record
+	unsigned size;
+};
+
 struct superblock
 {
 	/* Persistent, saved to disk */
@@ -296,15 +387,31 @@ struct superblock
 	u64 snapmask; // bitmask of all valid snapshots
 	unsigned runflags;
 	unsigned snapdev, metadev, orgdev;
-	unsigned snaplock_hash_bits;
+	unsigned snaplock_hash_bits, snaplock_count;
 	struct snaplock **snaplocks; // forward ref!!!
+	struct pool snaplock_pool, snaplock_wait_pool;
 	unsigned copybuf_size;
 	char *copybuf;
 	chunk_t source_chunk, dest_exception;
 	unsigned copy_chunks, deferred_allocs;
 	unsigned max_commit_blocks; // physical addresses that fit in a commit block
+	unsigned journal_since_barrier; // journal blocks that replay would need
+	sector_t saved_root; // tree root as last written to the superblock
+	unsigned saved_levels;
 	u16 usecount[MAX_SNAPSHOTS]; // transient usecount for connected devices
 	struct alloc_range deferred_alloc[MAX_DEFERRED_ALLOCS], defer;
+	struct alloc_range snap_extent; // snapdata chunks reserved for this request
+	struct unique_set unique; // origin chunks with exceptions for all of snapmask
+	struct list_head held_replies; // write replies waiting for the group commit
+	struct list_head replying; // clients with replies queued to send
+	unsigned commit_window; // usecs to hold a group commit open
+	u64 commit_due;
+	struct copyout *copyouts; // asynchronous copyout slots
+	unsigned copyout_depth, copyouts_busy; // no slots means synchronous copyout
+	int copyout_event; // completion fd to poll, or -1
+	struct free_summary *meta_summary, *snap_summary; // the same when combined
+	struct node_cache nodes; // pinned index nodes
+	u64 sharing[MAX_SNAPSHOTS * MAX_SNAPSHOTS] __attribute__((aligned(SECTOR_SIZE))); // chunks per snapshot by number of other sharers, direct io
 };
 
 static int valid_sb(struct superblock *sb)
@@ -427,6 +534,119 @@ static struct buffer *snapread(struct superblock const *sb, sector_t sector)
 	return bread(sb->metadev, sector, sb->metadata.allocsize);
 }
 
+/* Pin up to a quarter of the buffer cache, the same as the probation share */
+static int setup_node_cache(struct superblock *sb)
+{
+	struct node_cache *nodes = &sb->nodes;
+	unsigned bits = 4;
+
+	nodes->max = max_buffers / 4;
+	while ((1U << bits) < 2 * nodes->max)
+		bits++;
+	if (!(nodes->table = calloc(1 << bits, sizeof(struct pinned_node))))
+		return -ENOMEM;
+	nodes->bits = bits;
+	nodes->count = 0;
+	return 0;
+}
+
+static struct pinned_node *pinned_slot(struct node_cache *nodes, sector_t sector)
+{
+	unsigned mask = (1 << nodes->bits) - 1, i = buffer_hash(sector) & mask;
+
+	while (nodes->table[i].buffer && nodes->table[i].sector != sector)
+		i = (i + 1) & mask;
+	return nodes->table + i;
+}
+
+static void remove_pinned(struct node_cache *nodes, struct pinned_node *slot)
+{
+	unsigned mask = (1 << nodes->bits) - 1, i = slot - nodes->table, j = i;
+
+	brelse(slot->buffer);
+	nodes->count--;
+	nodes->pinned[slot->height]--;
+	/* Close the gap, moving up any entry that probed past it */
+	while (1) {
+		j = (j + 1) & mask;
+		if (!nodes->table[j].buffer)
+			break;
+		unsigned home = buffer_hash(nodes->table[j].sector) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			nodes->table[i] = nodes->table[j];
+			i = j;
+		}
+	}
+	nodes->table[i].buffer = NULL;
+}
+
+static void pin_node(struct superblock *sb, struct buffer *buffer, unsigned height)
+{
+	struct node_cache *nodes = &sb->nodes;
+	struct pinned_node *slot;
+
+	if (nodes->count == nodes->max) {
+		unsigned mask = (1 << nodes->bits) - 1, low = 0;
+
+		while (!nodes->pinned[low])
+			low++;
+		if (low >= height)
+			return;
+		while (!(slot = nodes->table + nodes->hand)->buffer || slot->height != low)
+			nodes->hand = (nodes->hand + 1) & mask;
+		remove_pinned(nodes, slot);
+	}
+	slot = pinned_slot(nodes, buffer->sector);
+	*slot = (struct pinned_node){ .sector = buffer->sector, .buffer = buffer, .height = height };
+	buffer->count++;
+	nodes->count++;
+	nodes->pinned[height]++;
+}
+
+/* Let go of a node, before its block is freed */
+static void unpin_node(struct superblock *sb, sector_t sector)
+{
+	struct pinned_node *slot;
+
+	if (sb->nodes.count && (slot = pinned_slot(&sb->nodes, sector))->buffer)
+		remove_pinned(&sb->nodes, slot);
+}
+
+static void unpin_nodes(struct superblock *sb)
+{
+	struct node_cache *nodes = &sb->nodes;
+
+	for (unsigned i = 0; nodes->table && i < 1U << nodes->bits; i++)
+		if (nodes->table[i].buffer)
+			brelse(nodes->table[i].buffer);
+	free(nodes->table);
+	*nodes = (struct node_cache){ };
+}
+
+/*
+ * Read an index node 'height' levels above the leaves, from the node cache
+ * if it is there, else from the buffer cache, pinning it for next time.
+ * Either way the caller gets a buffer to brelse() as usual.
+ */
+static struct buffer *read_node(struct superblock *sb, sector_t sector, unsigned height)
+{
+	struct buffer *buffer;
+
+	if (sb->nodes.table) {
+		struct pinned_node *slot = pinned_slot(&sb->nodes, sector);
+		if ((buffer = slot->buffer)) {
+			buffer->count++;
+			return buffer;
+		}
+	}
+	if (!(buffer = snapread(sb, sector)))
+		return NULL;
+	protect_buffer(buffer);
+	if (sb->nodes.max)
+		pin_node(sb, buffer, height);
+	return buffer;
+}
+
 static int bytebits(unsigned char c)
 {
 	unsigned count = 0;
@@ -450,6 +670,29 @@ static inline void clear_bitmap_bit(unsigned char *bitmap, unsigned bit)
 	bitmap[bit >> 3] &= ~(1 << (bit & 7));
 }
 
+static inline struct free_summary *alloc_summary(struct superblock *sb, struct allocspace *as)
+{
+	return as == &sb->metadata ? sb->meta_summary : sb->snap_summary;
+}
+
+static inline void adjust_summary(struct free_summary *summary, u64 block, int delta)
+{
+	if (summary && block < summary->blocks) {
+		summary->block[block] += delta;
+		summary->group[block >> SUMMARY_GROUP_BITS] += delta;
+	}
+}
+
+/* Which summary covers the bitmap at this byte offset, if any */
+static struct free_summary *bitmap_summary(struct superblock *sb, chunk_t base)
+{
+	if (base >> SECTOR_BITS == sb->metadata.asi->bitmap_base)
+		return sb->meta_summary;
+	if (!combined(sb) && base >> SECTOR_BITS == sb->snapdata.asi->bitmap_base)
+		return sb->snap_summary;
+	return NULL;
+}
+
 /*
  * flag = 0: check if bits for chunks from start_chunk to end_chunk are all zero
  * flag = 1: set bits for chunks from start_chunk to end_chunk
@@ -462,20 +705,30 @@ static int change_bits(struct superblock *sb, chunk_t start, chunk_t count, chun
 	unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3;
 	u64 bitmap_mask = (1 << bitmap_shift ) - 1;
 	sector_t sector = (base >> SECTOR_BITS) + ((start >> bitmap_shift) << sb->metadata.chunk_sectors_bits);
+	struct free_summary *summary = flag ? bitmap_summary(sb, base) : NULL;
 	trace(warn("start %Lu, count %Lu, base %Lu, flag %d, sector %Lu", start, count, base, flag, sector);)
 	for (chunk = start; chunk < limit; sector += chunk_sectors(&sb->metadata)) {
 		struct buffer *buffer = bread(sb->metadev, sector, sb->metadata.allocsize);
+		u64 block = chunk >> bitmap_shift;
+		int delta = 0;
 		do {
-			if (!flag && get_bitmap_bit(buffer->data, chunk & bitmap_mask)) {
+			int used = get_bitmap_bit(buffer->data, chunk & bitmap_mask);
+			if (!flag && used) {
 				warn("chunk %Lu is in use", chunk);
+				brelse(buffer);
 				return -1;
 			}
-			if (flag == 1)
+			if (flag == 1 && !used) {
 				set_bitmap_bit(buffer->data, chunk & bitmap_mask);
-			if (flag == 2)
+				delta--;
+			}
+			if (flag == 2 && used) {
 				clear_bitmap_bit(buffer->data, chunk & bitmap_mask);
+				delta++;
+			}
 			chunk++;
 		} while ((chunk & bitmap_mask) && (chunk < limit));
+		adjust_summary(summary, block, delta);
 		if (flag)
 			set_buffer_dirty(buffer);
 		brelse(buffer);
@@ -529,8 +782,94 @@ static chunk_t count_free(struct superblock *sb, struct allocspace *alloc)
 	return count_zeros(sb, alloc) - count_deferred(sb, alloc);
 }
 
+static void free_summary(struct free_summary *summary)
+{
+	if (summary) {
+		free(summary->block);
+		free(summary->group);
+		free(summary);
+	}
+}
+
+/*
+ * Count the clear bits in each block of the allocation bitmap, over the
+ * same bytes as count_zeros().
+ */
+static struct free_summary *build_summary(struct superblock *sb, struct allocspace *alloc)
+{
+	unsigned blocksize = sb->metadata.allocsize, blocks = alloc->asi->bitmap_blocks;
+	unsigned groups = (blocks + SUMMARY_GROUP - 1) >> SUMMARY_GROUP_BITS;
+	struct free_summary *summary = malloc(sizeof(*summary));
+	unsigned char zeroes[256];
+
+	if (!summary)
+		return NULL;
+	*summary = (struct free_summary){ .blocks = blocks, .groups = groups,
+		.block = calloc(blocks, sizeof(u32)), .group = calloc(groups, sizeof(u32)) };
+	if (!summary->block || !summary->group)
+		goto fail;
+	for (int i = 0; i < 256; i++)
+		zeroes[i] = bytebits(~i);
+	chunk_t bytes = (alloc->asi->chunks + 7) >> 3;
+	for (unsigned block = 0; block < blocks && bytes; block++) {
+		struct buffer *buffer = snapread(sb, alloc->asi->bitmap_base + ((u64)block << sb->metadata.chunk_sectors_bits));
+		if (!buffer)
+			goto fail;
+		unsigned char *p = buffer->data;
+		unsigned n = blocksize < bytes ? blocksize : bytes, count = 0;
+		bytes -= n;
+		while (n--)
+			count += zeroes[*p++];
+		brelse(buffer);
+		summary->block[block] = count;
+		summary->group[block >> SUMMARY_GROUP_BITS] += count;
+	}
+	return summary;
+fail:
+	free_summary(summary);
+	return NULL;
+}
+
+/*
+ * (Re)build the free space summaries from the bitmaps.  Without one the
+ * allocator just searches the bitmap as it always did.
+ */
+static void setup_summary(struct superblock *sb)
+{
+	free_summary(sb->meta_summary);
+	if (sb->snap_summary != sb->meta_summary)
+		free_summary(sb->snap_summary);
+	sb->meta_summary = build_summary(sb, &sb->metadata);
+	sb->snap_summary = combined(sb) ? sb->meta_summary : build_summary(sb, &sb->snapdata);
+	if (!sb->meta_summary || !sb->snap_summary)
+		warn("unable to build free space summary");
+}
+
+static void check_summary(struct superblock *sb, struct allocspace *alloc)
+{
+	struct free_summary *summary = alloc_summary(sb, alloc);
+	chunk_t total = 0, counted;
+
+	if (!summary)
+		return;
+	for (unsigned group = 0; group < summary->groups; group++) {
+		unsigned block = group << SUMMARY_GROUP_BITS, end = block + SUMMARY_GROUP;
+		u64 sum = 0;
+		for (; block < end && block < summary->blocks; block++)
+			sum += summary->block[block];
+		if (sum != summary->group[group])
+			warn("free summary group %u has %u, blocks add up to %Lu", group, summary->group[group], (llu_t)sum);
+		total += sum;
+	}
+	if (total != (counted = count_zeros(sb, alloc)))
+		warn("free summary has %Lu clear bits, bitmap has %Lu", (llu_t)total, (llu_t)counted);
+}
+
 static void check_freespace(struct superblock *sb)
 {
+	check_summary(sb, &sb->metadata);
+	if (!combined(sb))
+		check_summary(sb, &sb->snapdata);
 	chunk_t counted = count_free(sb, &sb->metadata);
 	if (sb->metadata.asi->freechunks != counted) {
 		warn("metadata free chunks count wrong: counted %Lu, free = %Li", (llu_t) counted, sb->metadata.asi->freechunks);
@@ -553,14 +892,20 @@ static void selfcheck_freespace(struct superblock *sb)
 
 static void flush_journaled_buffers(void)
 {
-	while (!list_empty(&journaled_buffers)) {
-		struct list_head *entry = journaled_buffers.next;
-		struct buffer *buffer = list_entry(entry, struct buffer, dirty_list);
+	struct buffer *vec[journaled_count + 1];
+	struct list_head *list;
+	unsigned count = 0;
+
+	list_for_each(list, &journaled_buffers) {
+		struct buffer *buffer = list_entry(list, struct buffer, dirty_list);
 		jtrace(warn("write data sector = %Lx", buffer->sector););
-		if (write_buffer_to(buffer, buffer->sector))
-			warn("unable to write commit block to journal");
-		set_buffer_uptodate(buffer);
+		vec[count++] = buffer;
 	}
+	if (write_buffers(vec, count))
+		warn("unable to write journaled blocks");
+	/* any left here failed to write, warned above */
+	while (!list_empty(&journaled_buffers))
+		set_buffer_uptodate(list_entry(journaled_buffers.next, struct buffer, dirty_list));
 	assert(journaled_count == 0);
 }
 
@@ -590,17 +935,23 @@ static void flush_deferred_allocs(struct superblock *sb)
  * transaction stays small enough to fit in the journal.
  *
  * Since we don't have any asynchronous IO at the moment, journal commit is
- * straightforward: walk through the dirty blocks once, writing them to the
- * journal, then again, adding block addresses to the commit block.  We know
- * the dirty list didn't change between the two passes.  When ansynchronous
- * IO arrives here, this all has to be handled a lot more carefully.
+ * straightforward: gather the dirty blocks, write them to consecutive
+ * journal blocks with one vectored write per run (a run only breaks where
+ * the journal wraps), then add their block addresses to the commit block in
+ * the same order.  When ansynchronous IO arrives here, this all has to be
+ * handled a lot more carefully.
  */
+static void drain_copyouts(struct superblock *sb);
+static void save_sb(struct superblock *sb);
+
 static void commit_transaction(struct superblock *sb, int barrier)
 {
+	drain_copyouts(sb);
 	if (list_empty(&dirty_buffers) && !sb->defer.count)
 		return;
 
-	if (sb->deferred_allocs >= sb->image.journal_size / 2 || journaled_count >= sb->image.journal_size / 2) {
+	if (sb->deferred_allocs >= sb->image.journal_size / 2 || journaled_count >= sb->image.journal_size / 2 ||
+	    sb->journal_since_barrier + dirty_buffer_count + 1 >= sb->image.journal_size / 2) {
 		flush_journaled_buffers();
 		flush_deferred_allocs(sb);
 		barrier = 1;
@@ -608,26 +959,35 @@ static void commit_transaction(struct superblock *sb, int barrier)
 
 //warn(">>> %i <<<", sb->image.sequence);
 	struct list_head *list;
-	int safety = dirty_buffer_count;
+	unsigned count = 0, i, run;
+	struct buffer *vec[dirty_buffer_count + 1];
 
-	/*
-	 * Write each dirty buffer sequentially to the journal.
-	 */
 	list_for_each(list, &dirty_buffers) {
 		struct buffer *buffer = list_entry(list, struct buffer, dirty_list);
-		unsigned pos = next_journal_block(sb);
-		jtrace(warn("journal data block @%Lx [%u]", buffer->sector, pos););
 		if (!buffer_dirty(buffer)) {
 			warn("non-dirty buffer %i of %i found on dirty list, state = %i",
-				dirty_buffer_count - safety + 1, dirty_buffer_count, buffer->state);
+				count + 1, dirty_buffer_count, buffer->state);
 			show_dirty_buffers();
 			die(123);
 		}
-		if (write_buffer_to(buffer, journal_sector(sb, pos)))
+		assert(count < dirty_buffer_count);
+		vec[count++] = buffer;
+	}
+	assert(count == dirty_buffer_count);
+
+	/*
+	 * Write the dirty buffers sequentially to the journal.
+	 */
+	for (i = 0; i < count; i += run) {
+		unsigned pos = sb->image.journal_next;
+		run = count - i;
+		if (run > sb->image.journal_size - pos)
+			run = sb->image.journal_size - pos;
+		sb->image.journal_next = (pos + run) % sb->image.journal_size;
+		jtrace(warn("journal %u data blocks from @%Lx [%u]", run, vec[i]->sector, pos););
+		if (write_buffers_to(vec + i, run, journal_sector(sb, pos)))
 			jtrace(warn("unable to write dirty blocks to journal"););
-		assert(safety--);
 	}
-	assert(!safety);
 
 	/*
 	 * Prepare the commit block, add the block address for each of the
@@ -640,10 +1000,9 @@ static void commit_transaction(struct superblock *sb, int barrier)
 	struct commit_block *commit = buf2commit(commit_buffer);
 	*commit = (struct commit_block){ .magic = JMAGIC, .sequence = sb->image.sequence++ };
 
-	list_for_each(list, &dirty_buffers) {
-		struct buffer *buffer = list_entry(list, struct buffer, dirty_list);
+	for (i = 0; i < count; i++) {
 		assert(commit->entries < sb->max_commit_blocks);
-		commit->sector[commit->entries++] = buffer->sector;
+		commit->sector[commit->entries++] = vec[i]->sector;
 	}
 
 	jtrace(warn("commit journal block [%u]", pos););
@@ -675,20 +1034,20 @@ static void commit_transaction(struct superblock *sb, int barrier)
 			jtrace(warn("move buffer to journaled_list, sector = %Lx", buffer->sector););
 			add_buffer_journaled(buffer);
 		}
+		sb->journal_since_barrier += count + 1;
 	} else {
 		/*
-	 	* Now write each dirty buffer to its proper location.
-	 	* TODO: this can be merged with the above flush_journaled_buffers() code.
+	 	* Now write each dirty buffer to its proper location, sorted and
+	 	* coalesced into runs of adjacent sectors.
 	 	*/
-		while (!list_empty(&dirty_buffers)) {
-			struct list_head *entry = dirty_buffers.next;
-			struct buffer *buffer = list_entry(entry, struct buffer, dirty_list);
-			jtrace(warn("write data sector = %Lx", buffer->sector););
-			assert(buffer_dirty(buffer));
-			if (write_buffer(buffer)) // deletes it from dirty (fixme: fragile)
-				jtrace(warn("unable to write commit block to journal"););
-		}
+		if (write_buffers(vec, count)) // deletes them from dirty (fixme: fragile)
+			jtrace(warn("unable to write dirty blocks home"););
+		if (barrier)
+			sb->journal_since_barrier = 0;
 	}
+	/* A new tree root only counts once the superblock points at it */
+	if (sb->image.etree_root != sb->saved_root || sb->image.etree_levels != sb->saved_levels)
+		save_sb(sb);
 	/* checking free chunks for debugging purpose only,, return before this to skip the checking */
 	selfcheck_freespace(sb);
 }
@@ -830,9 +1189,9 @@ static int replay_journal(struct superblock *sb)
 			struct buffer *databuf = jread(sb, replay);
 			if (is_commit_block(buf2commit(databuf)))
 				error("data block [%u] marked as commit block", replay);
-			jtrace(warn("write journal [%u] data to %Lx", replay, commit->sector[i]););
-			warn("write journal [%u] data to %Lx", replay, commit->sector[i]);
-			write_buffer_to(databuf, commit->sector[i]);
+			jtrace(warn("write journal [%u] data to %Lx", replay, commit->sector[j]););
+			warn("write journal [%u] data to %Lx", replay, commit->sector[j]);
+			write_buffer_to(databuf, commit->sector[j]);
 			brelse(databuf);
 		}
 		if (i != newest)
@@ -895,13 +1254,27 @@ failed:
  * btree leaf todo:
  *   - Check leaf, index structure
  *   - Mechanism for identifying which snapshots are in each leaf
- *   - binsearch for leaf, index lookup
+ *   - binsearch for index lookup
  *   - enforce 32 bit address range within leaf
  */
 
 static unsigned leaf_freespace(struct eleaf *leaf);
 static unsigned leaf_payload(struct eleaf *leaf);
 
+/*
+ * Return the index of the map entry whose run covers the target chunk, or
+ * failing that, of the first entry past it (possibly the sentinel).
+ */
+static unsigned find_run(struct eleaf *leaf, unsigned target)
+{
+	return map_search(leaf->map, leaf->count, target);
+}
+
+static inline int in_run(struct eleaf *leaf, unsigned i, unsigned target)
+{
+	return i < leaf->count && leaf->map[i].rchunk <= target;
+}
+
 /*
  * origin_chunk_unique: an origin logical chunk is shared unless all snapshots
  * have exceptions.
@@ -909,14 +1282,13 @@ static unsigned leaf_payload(struct eleaf *leaf);
 static int origin_chunk_unique(struct eleaf *leaf, u64 chunk, u64 snapmask)
 {
 	u64 using = 0;
-	u64 i, target = chunk - leaf->base_chunk;
+	unsigned i, target = chunk - leaf->base_chunk;
 	struct exception const *p;
 
-	for (i = 0; i < leaf->count; i++)
-		if (leaf->map[i].rchunk == target)
-			goto found;
-	return !snapmask;
-found:
+	i = find_run(leaf, target);
+	if (!in_run(leaf, i, target))
+		return !snapmask;
+
 	for (p = emap(leaf, i); p < emap(leaf, i+1); p++)
 		using |= p->share;
 
@@ -934,15 +1306,13 @@ static int snapshot_chunk_unique(struct eleaf *leaf, u64 chunk, int snapbit, chu
 	unsigned i, target = chunk - leaf->base_chunk;
 	struct exception const *p;
 
-	for (i = 0; i < leaf->count; i++)
-		if (leaf->map[i].rchunk == target)
-			goto found;
-	return 0;
-found:
+	i = find_run(leaf, target);
+	if (!in_run(leaf, i, target))
+		return 0;
 	for (p = emap(leaf, i); p < emap(leaf, i+1); p++)
 		/* shared if more than one bit set including this one */
 		if ((p->share & mask)) {
-			*exception = p->chunk;
+			*exception = p->chunk + (target - leaf->map[i].rchunk);
 			return !(p->share & ~mask);
 		}
 	return 0;
@@ -950,7 +1320,8 @@ found:
 
 /*
  * add_exception_to_leaf:
- *  - cycle through map to find existing logical chunk or insertion point
+ *  - cycle through map to find run holding logical chunk or insertion point
+ *  - if found in a longer run, split the chunk out into a run of one
  *  - if not found need to add new chunk address
  *      - move tail of map up
  *      - store new chunk address in map
@@ -964,6 +1335,7 @@ found:
  *      - move head of exceptions down
  *      - store new exception/sharemap
  *      - adjust map head offsets
+ *  - join with neighbouring runs where possible
  *
  * If the new exception won't fit in the leaf, return an error so that
  * higher level code may split the leaf and try again.  This keeps the
@@ -991,48 +1363,201 @@ static unsigned leaf_payload(struct eleaf *leaf)
 	return lower + upper;
 }
 
+/*
+ * Leaf editing primitives.  Exception lists are packed against the end of
+ * the block in map order, so list i runs from emap(leaf, i) up to
+ * emap(leaf, i+1) and growing or shrinking a list moves all the lists
+ * below it.  The caller checks for free space.
+ */
+
+/* Open up room for count exceptions at the front of list i */
+static struct exception *grow_list(struct eleaf *leaf, unsigned i, unsigned count)
+{
+	struct exception *base = emap(leaf, 0), *at = emap(leaf, i);
+	unsigned j;
+
+	memmove(base - count, base, (char *)at - (char *)base);
+	for (j = 0; j <= i; j++)
+		leaf->map[j].offset -= count * sizeof(struct exception);
+	return at - count;
+}
+
+/* Close up count exceptions at p, which is in list i */
+static void shrink_list(struct eleaf *leaf, unsigned i, struct exception *p, unsigned count)
+{
+	struct exception *base = emap(leaf, 0);
+	unsigned j;
+
+	memmove(base + count, base, (char *)p - (char *)base);
+	for (j = 0; j <= i; j++)
+		leaf->map[j].offset += count * sizeof(struct exception);
+}
+
+/* Insert a map entry with an empty exception list before map[i] */
+static void insert_map(struct eleaf *leaf, unsigned i, unsigned rchunk, unsigned chunks)
+{
+	memmove(&leaf->map[i + 1], &leaf->map[i], (leaf->count + 1 - i) * sizeof(struct etree_map));
+	leaf->map[i].rchunk = rchunk;
+	leaf->map[i].run = chunks - 1;
+	leaf->count++;
+}
+
+/* Remove map[i], which must have an empty exception list */
+static void remove_map(struct eleaf *leaf, unsigned i)
+{
+	memmove(&leaf->map[i], &leaf->map[i + 1], (leaf->count - i) * sizeof(struct etree_map));
+	leaf->count--;
+}
+
+/*
+ * Split the run of map[i] after its first 'at' chunks.  The tail becomes
+ * map[i+1], with its own copy of the exception list.
+ */
+static int split_run(struct eleaf *leaf, unsigned i, unsigned at)
+{
+	unsigned count = emap(leaf, i+1) - emap(leaf, i);
+	struct exception *p;
+
+	assert(at && at < run_chunks(leaf, i));
+	if (leaf_freespace(leaf) < sizeof(struct etree_map) + count * sizeof(struct exception))
+		return -EFULL;
+	insert_map(leaf, i + 1, leaf->map[i].rchunk + at, run_chunks(leaf, i) - at);
+	leaf->map[i].run = at - 1;
+	p = grow_list(leaf, i, count);
+	memcpy(p, p + count, count * sizeof(struct exception));
+	leaf->map[i + 1].offset = (char *)(p + count) - (char *)leaf;
+	for (p += count; p < emap(leaf, i + 2); p++)
+		p->chunk += at;
+	return 0;
+}
+
+/*
+ * If the run of map[i+1] carries on where the run of map[i] ends, with the
+ * same share masks and contiguous exceptions, fold it into map[i].
+ */
+static int join_runs(struct eleaf *leaf, unsigned i)
+{
+	struct etree_map *map = leaf->map + i;
+	struct exception *p, *q;
+	unsigned chunks = run_chunks(leaf, i), count, j;
+
+	if (i + 1 >= leaf->count || map[0].rchunk + chunks != map[1].rchunk)
+		return 0;
+	if (chunks + run_chunks(leaf, i + 1) > MAX_LEAF_RUN)
+		return 0;
+	p = emap(leaf, i);
+	q = emap(leaf, i+1);
+	if ((count = q - p) != emap(leaf, i+2) - q)
+		return 0;
+	for (j = 0; j < count; j++)
+		if (p[j].share != q[j].share || p[j].chunk + chunks != q[j].chunk)
+			return 0;
+	map[0].run += map[1].run + 1;
+	shrink_list(leaf, i + 1, q, count);
+	remove_map(leaf, i + 1);
+	return 1;
+}
+
+/* A very simple-minded implementation.  You can do it in very
+ * few operations with whole-register bit twiddling but I assume
+ * that we can juse find a macro somewhere which works.
+ *  AKA hamming weight, sideways add
+ */
+static unsigned int bit_count(u64 num)
+{
+	unsigned count = 0;
+
+	for (; num; num >>= 1)
+		if (num & 1)
+			count++;
+
+	return count;
+}
+
+/*
+ * Sharing statistics
+ *
+ * The status report gives, for each snapshot, how many chunks it shares
+ * with exactly n other snapshots: sharing[MAX_SNAPSHOTS * bit + n].  An
+ * exception whose share mask has k bits set adds its run length to entry
+ * k-1 of the row of each of those bits.  This used to be counted by a pass
+ * over the whole btree for every status request; now every change to a
+ * share mask adjusts the table as it happens, so the table stays current
+ * and is only counted from scratch when the server starts after a crash.
+ */
+static void account_sharing(u64 *sharing, u64 share, int64_t chunks)
+{
+	unsigned count = bit_count(share) - 1;
+
+	if (!sharing)
+		return;
+	for (; share; share &= share - 1)
+		sharing[MAX_SNAPSHOTS * __builtin_ctzll(share) + count] += chunks;
+}
+
+/* A share mask on a run of chunks changed from old to new */
+static void change_sharing(u64 *sharing, u64 old, u64 new, unsigned chunks)
+{
+	account_sharing(sharing, old, -(int64_t)chunks);
+	account_sharing(sharing, new, chunks);
+}
+
+/* Metadata blocks for the sharing table checkpoint, which follows the journal */
+static unsigned sharing_blocks(struct superblock *sb)
+{
+	return DIVROUND(sizeof(sb->sharing), 1 << sb->metadata.asi->allocsize_bits);
+}
+
 /*
  * Add an "exception" to a b-tree leaf.
  *
- * Finds the chunk to which we're adding the exception.  If it doesn't exist
+ * Finds the chunk to which we're adding the exception.  If it is part of a
+ * longer run, split it out into a run of its own first.  If it doesn't exist
  * in the leaf, add it.  Compute the share mask and insert the exception at
- * the appropriate place.  Return an error if there isn't enough room for the
- * new entry.
+ * the appropriate place, then try to join the chunk to the runs on either
+ * side.  Return an error if there isn't enough room for the new entry.
  */
-static int add_exception_to_leaf(struct eleaf *leaf, u64 chunk, u64 exception, int snapshot, u64 active)
+static int add_exception_to_leaf(struct eleaf *leaf, u64 chunk, u64 exception, int snapshot, u64 active, u64 *sharing)
 {
 	unsigned target = chunk - leaf->base_chunk;
 	u64 mask = 1ULL << snapshot, sharemap;
-	struct exception *ins, *exceptions = emap(leaf, 0);
-	char *maptop = (char *)(&leaf->map[leaf->count + 1]); // include sentinel
-	unsigned i, j, free = (char *)exceptions - maptop;
+	struct exception *ins;
+	unsigned i;
+	int err;
 
-	trace(warn("chunk %Lx exception %Lx, snapshot = %i free space = %u", 
-		chunk, exception, snapshot, free););
+	trace(warn("chunk %Lx exception %Lx, snapshot = %i free space = %u",
+		chunk, exception, snapshot, leaf_freespace(leaf)););
 
 	/*
 	 * Find the chunk for which we're adding an exception entry.
 	 */
-	for (i = 0; i < leaf->count; i++) // !!! binsearch goes here
-		if (leaf->map[i].rchunk >= target)
-			break;
+	i = find_run(leaf, target);
 
 	/*
 	 * If we didn't find the chunk, insert a new one at map[i].
 	 */
-	if (i == leaf->count || leaf->map[i].rchunk > target) {
-		if (free < sizeof(struct exception) + sizeof(struct etree_map))
+	if (!in_run(leaf, i, target)) {
+		if (leaf_freespace(leaf) < sizeof(struct exception) + sizeof(struct etree_map))
 			return -EFULL;
-		ins = emap(leaf, i);
-		memmove(&leaf->map[i+1], &leaf->map[i], maptop - (char *)&leaf->map[i]);
-		leaf->map[i].offset = (char *)ins - (char *)leaf;
-		leaf->map[i].rchunk = target;
-		leaf->count++;
+		insert_map(leaf, i, target, 1);
 		sharemap = snapshot == -1? active: mask;
 		goto insert;
 	}
 
-	if (free < sizeof(struct exception))
+	/*
+	 * The new exception belongs to this chunk alone, so cut the chunk out
+	 * of the run it is in.  If that leaves the leaf too full to finish,
+	 * no harm done: the runs still describe the same exceptions.
+	 */
+	if (target > leaf->map[i].rchunk) {
+		if ((err = split_run(leaf, i, target - leaf->map[i].rchunk)))
+			return err;
+		i++;
+	}
+	if (leaf->map[i].run && (err = split_run(leaf, i, 1)))
+		return err;
+
+	if (leaf_freespace(leaf) < sizeof(struct exception))
 		return -EFULL;
 	/*
 	 * Compute the share map from that of each existing exception entry
@@ -1055,63 +1580,293 @@ static int add_exception_to_leaf(struct eleaf *leaf, u64 chunk, u64 exception, i
 	} else {
 		for (ins = emap(leaf, i); ins < emap(leaf, i+1); ins++)
 			if ((ins->share & mask)) {
+				change_sharing(sharing, ins->share, ins->share & ~mask, 1);
 				ins->share &= ~mask;
 				break;
 			}
 		sharemap = mask;
 	}
-	ins = emap(leaf, i);
 insert:
 	/*
-	 * Insert the new exception entry.  These grow from the end of the
-	 * block toward the beginning.  First move any earlier exceptions up
-	 * to make room for the new one, then insert the new entry in the
-	 * space freed.  Adjust the offsets for all earlier chunks.
+	 * Insert the new exception entry at the head of the list for this
+	 * chunk.  The lists grow from the end of the block toward the
+	 * beginning, so this moves all earlier lists down.
 	 */
-	memmove(exceptions - 1, exceptions, (char *)ins - (char *)exceptions);
-	ins--;
+	ins = grow_list(leaf, i, 1);
 	ins->share = sharemap;
 	ins->chunk = exception;
+	account_sharing(sharing, sharemap, 1);
 
-	for (j = 0; j <= i; j++)
-		leaf->map[j].offset -= sizeof(struct exception);
-
+	/*
+	 * Rejoin the neighbours, which is what collapses a region copied out
+	 * chunk by chunk to contiguous exceptions into a single run.
+	 */
+	join_runs(leaf, i);
+	if (i)
+		join_runs(leaf, i - 1);
 	return 0;
 }
 
 /*
- * Split a leaf.
+ * Batched exception insertion
  *
- * This routine splits a b-tree leaf at the middle chunk.  It copies that
- * and later map entries along with the associated lists of exceptions to
- * the new leaf.  It moves the remaining exception lists to the end of the
- * original block then adjusts the offsets for those map entries and the
- * counts for each leaf.  It returns the chunk at which the leaf was split
- * (which is now the first chunk in the new leaf).
+ * A write copies out a range of chunks in order, and adding the exceptions
+ * one at a time edits the same leaf over and over: each one cuts its chunk
+ * out of a run, moves every list below it and joins the runs up again.
+ * Instead, the new exceptions for the leaf in hand are queued in chunk
+ * order and merged in one pass that copies the leaf into a scratch map and
+ * exception array, cutting runs around the new chunks and joining runs as
+ * it goes.  The result is written back over the leaf, or split across it
+ * and one new leaf if it no longer fits.
  */
-static u64 split_leaf(struct eleaf *leaf, struct eleaf *leaf2)
-{
-	unsigned i, nhead = (leaf->count + 1) / 2, ntail = leaf->count - nhead, tailsize;
-	/* Should split at middle of data instead of median exception */
-	u64 splitpoint = leaf->map[nhead].rchunk + leaf->base_chunk;
-	char *phead, *ptail;
+#define BATCH_EXCEPTIONS 64
 
-	phead = (char *)emap(leaf, 0);
-	ptail = (char *)emap(leaf, nhead);
-	tailsize = (char *)emap(leaf, leaf->count) - ptail;
+struct new_exception
+{
+	chunk_t chunk, exception;
+	u64 share, unshared; // set by the merge, for the sharing statistics
+};
 
-	/* Copy upper half to new leaf */
-	memcpy(leaf2, leaf, offsetof(struct eleaf, map)); // header
-	memcpy(&leaf2->map[0], &leaf->map[nhead], (ntail + 1) * sizeof(struct etree_map)); // map
-	memcpy(ptail - (char *)leaf + (char *)leaf2, ptail, tailsize); // data
-	leaf2->count = ntail;
+struct leaf_build
+{
+	struct etree_map *map; // offsets are indices into ex
+	struct exception *ex;
+	unsigned maps, exceptions, max_maps, max_exceptions;
+};
 
-	/* Move lower half to top of block */
+/* Append a map entry for a run with room for its list of count exceptions */
+static struct exception *open_run(struct leaf_build *b, unsigned rchunk, unsigned chunks, unsigned count)
+{
+	if (b->maps == b->max_maps || b->exceptions + count > b->max_exceptions)
+		return NULL;
+	b->map[b->maps++] = (struct etree_map){ .offset = b->exceptions, .run = chunks - 1, .rchunk = rchunk };
+	b->exceptions += count;
+	return b->ex + b->exceptions - count;
+}
+
+/* As join_runs(), fold the run just appended into the one before if it can */
+static void close_run(struct leaf_build *b)
+{
+	struct etree_map *map = b->map + b->maps - 2;
+	unsigned chunks, count, j;
+
+	if (b->maps < 2)
+		return;
+	chunks = map[0].run + 1;
+	count = map[1].offset - map[0].offset;
+	if (map[0].rchunk + chunks != map[1].rchunk || chunks + map[1].run + 1 > MAX_LEAF_RUN)
+		return;
+	if (b->exceptions - map[1].offset != count)
+		return;
+	for (j = 0; j < count; j++)
+		if (b->ex[map[0].offset + j].share != b->ex[map[1].offset + j].share ||
+		    b->ex[map[0].offset + j].chunk + chunks != b->ex[map[1].offset + j].chunk)
+			return;
+	map[0].run += map[1].run + 1;
+	b->exceptions = map[1].offset;
+	b->maps--;
+}
+
+/* Copy the given chunks of the run of map[i], starting 'from' chunks in */
+static int copy_run(struct leaf_build *b, struct eleaf *leaf, unsigned i, unsigned from, unsigned chunks)
+{
+	struct exception *p = emap(leaf, i), *end = emap(leaf, i+1), *q;
+
+	if (!(q = open_run(b, leaf->map[i].rchunk + from, chunks, end - p)))
+		return -EFULL;
+	for (; p < end; p++, q++)
+		*q = (struct exception){ .share = p->share, .chunk = p->chunk + from };
+	close_run(b);
+	return 0;
+}
+
+/*
+ * Add a run of one chunk holding the new exception followed by the existing
+ * exceptions for that chunk, if map[i] covers it (i is -1 if nothing does).
+ * The share masks work out as in add_exception_to_leaf().
+ */
+static int build_exception(struct leaf_build *b, struct eleaf *leaf, int i, unsigned target, struct new_exception *new, int snapbit, u64 active)
+{
+	struct exception *p = NULL, *end = NULL, *q;
+	u64 mask = 1ULL << snapbit, using = 0;
+	unsigned from = 0, count = 0;
+
+	if (i >= 0) {
+		p = emap(leaf, i);
+		end = emap(leaf, i+1);
+		from = target - leaf->map[i].rchunk;
+		count = end - p;
+	}
+	if (!(q = open_run(b, target, 1, 1 + count)))
+		return -EFULL;
+	for (struct exception *r = p; r < end; r++)
+		using |= r->share;
+	new->share = snapbit == -1? ~using & active: mask;
+	new->unshared = 0;
+	*q++ = (struct exception){ .share = new->share, .chunk = new->exception };
+	for (; p < end; p++, q++) {
+		*q = (struct exception){ .share = p->share, .chunk = p->chunk + from };
+		if (snapbit != -1 && !new->unshared && (p->share & mask)) {
+			new->unshared = p->share;
+			q->share &= ~mask;
+		}
+	}
+	close_run(b);
+	return 0;
+}
+
+/*
+ * Merge a batch of new exceptions, sorted by chunk and all within the
+ * range of the leaf, with the contents of the leaf, appending the result
+ * to whatever is in the scratch space already.  Fails if it doesn't fit.
+ */
+static int build_leaf(struct leaf_build *b, struct eleaf *leaf, struct new_exception *batch, unsigned count, int snapbit, u64 active)
+{
+	unsigned i, k = 0, target;
+
+	for (i = 0; i < leaf->count; i++) {
+		unsigned rchunk = leaf->map[i].rchunk, end = rchunk + run_chunks(leaf, i), pos = rchunk;
+
+		for (; k < count && (target = batch[k].chunk - leaf->base_chunk) < end; k++) {
+			if (target < rchunk) {
+				if (build_exception(b, leaf, -1, target, batch + k, snapbit, active))
+					return -EFULL;
+				continue;
+			}
+			if (target > pos && copy_run(b, leaf, i, pos - rchunk, target - pos))
+				return -EFULL;
+			if (build_exception(b, leaf, i, target, batch + k, snapbit, active))
+				return -EFULL;
+			pos = target + 1;
+		}
+		if (pos < end && copy_run(b, leaf, i, pos - rchunk, end - pos))
+			return -EFULL;
+	}
+	for (; k < count; k++)
+		if (build_exception(b, leaf, -1, batch[k].chunk - leaf->base_chunk, batch + k, snapbit, active))
+			return -EFULL;
+	b->map[b->maps].offset = b->exceptions;
+	return 0;
+}
+
+/* Bytes a leaf holding map entries from..to-1 of the merge would use */
+static unsigned built_size(struct leaf_build *b, unsigned from, unsigned to)
+{
+	return sizeof(struct eleaf) + (to - from + 1) * sizeof(struct etree_map) +
+		(b->map[to].offset - b->map[from].offset) * sizeof(struct exception);
+}
+
+/* Append the runs of a leaf that gets no new exceptions, a sibling */
+static int build_sibling(struct leaf_build *b, struct eleaf *leaf)
+{
+	unsigned i;
+
+	for (i = 0; i < leaf->count; i++)
+		if (copy_run(b, leaf, i, 0, run_chunks(leaf, i)))
+			return -EFULL;
+	b->map[b->maps].offset = b->exceptions;
+	return 0;
+}
+
+/*
+ * Choose where to cut the merge into 'parts' leaves of about equal payload
+ * bytes: cut[k] is the first map entry of leaf k, cut[parts] the end.
+ * Fails unless each leaf comes to at most 'limit' bytes.
+ */
+static int cut_build(struct leaf_build *b, unsigned parts, unsigned limit, unsigned cut[])
+{
+	unsigned total = built_size(b, 0, b->maps), i = 0, k;
+
+	cut[0] = 0;
+	cut[parts] = b->maps;
+	for (k = 1; k < parts; k++) {
+		unsigned want = total * k / parts;
+		while (i < b->maps && built_size(b, 0, i) < want)
+			i++;
+		if (i > cut[k - 1] + 1 && want - built_size(b, 0, i - 1) < built_size(b, 0, i) - want)
+			i--;
+		cut[k] = i;
+	}
+	for (k = 0; k < parts; k++)
+		if (cut[k] >= cut[k + 1] || built_size(b, cut[k], cut[k + 1]) > limit)
+			return -EFULL;
+	return 0;
+}
+
+/*
+ * Replace the contents of the leaf with map entries from..to-1 of the
+ * merge, packing their lists against 'top', the end of the block.
+ */
+static void write_leaf(struct eleaf *leaf, struct leaf_build *b, unsigned from, unsigned to, unsigned top)
+{
+	unsigned first = b->map[from].offset, count = b->map[to].offset - first, i;
+	struct exception *base = (struct exception *)((char *)leaf + top) - count;
+
+	memcpy(base, b->ex + first, count * sizeof(struct exception));
+	leaf->count = to - from;
+	for (i = 0; i < leaf->count; i++) {
+		leaf->map[i] = b->map[from + i];
+		leaf->map[i].offset = (char *)(base + b->map[from + i].offset - first) - (char *)leaf;
+	}
+	leaf->map[i] = (struct etree_map){ .offset = top };
+}
+
+/*
+ * Split a leaf.
+ *
+ * This routine splits a b-tree leaf at the map entry that divides its
+ * payload (map entries plus exception lists) most nearly in half.  It copies
+ * that and later map entries along with the associated lists of exceptions
+ * to the new leaf.  It moves the remaining exception lists to the end of the
+ * original block then adjusts the offsets for those map entries and the
+ * counts for each leaf.  It returns the chunk at which the leaf was split
+ * (which is now the first chunk in the new leaf).
+ *
+ * A leaf holding a single run is split in the middle of the run instead,
+ * both halves keeping a copy of the exception list.
+ */
+static u64 split_leaf(struct eleaf *leaf, struct eleaf *leaf2)
+{
+	unsigned i, nhead, ntail, tailsize, half = leaf_payload(leaf) / 2;
+	char *phead, *ptail;
+	u64 splitpoint;
+
+	if (leaf->count == 1 && leaf->map[0].run) {
+		unsigned at = run_chunks(leaf, 0) / 2;
+		struct exception *p;
+
+		memcpy(leaf2, leaf, offsetof(struct eleaf, map[2])); // header and map
+		memcpy(emap(leaf2, 0), emap(leaf, 0), (char *)emap(leaf, 1) - (char *)emap(leaf, 0));
+		leaf2->map[0].rchunk += at;
+		leaf2->map[0].run -= at;
+		for (p = emap(leaf2, 0); p < emap(leaf2, 1); p++)
+			p->chunk += at;
+		leaf->map[0].run = at - 1;
+		return leaf2->map[0].rchunk + leaf2->base_chunk;
+	}
+
+	for (nhead = 1; nhead + 1 < leaf->count; nhead++)
+		if (nhead * sizeof(struct etree_map) + ((char *)emap(leaf, nhead) - (char *)emap(leaf, 0)) >= half)
+			break;
+	ntail = leaf->count - nhead;
+	splitpoint = leaf->map[nhead].rchunk + leaf->base_chunk;
+	phead = (char *)emap(leaf, 0);
+	ptail = (char *)emap(leaf, nhead);
+	tailsize = (char *)emap(leaf, leaf->count) - ptail;
+
+	/* Copy upper half to new leaf */
+	memcpy(leaf2, leaf, offsetof(struct eleaf, map)); // header
+	memcpy(&leaf2->map[0], &leaf->map[nhead], (ntail + 1) * sizeof(struct etree_map)); // map
+	memcpy(ptail - (char *)leaf + (char *)leaf2, ptail, tailsize); // data
+	leaf2->count = ntail;
+
+	/* Move lower half to top of block */
 	memmove(phead + tailsize, phead, ptail - phead);
 	leaf->count = nhead;
 	for (i = 0; i <= nhead; i++) // also adjust sentinel
 		leaf->map[i].offset += tailsize;
 	leaf->map[nhead].rchunk = 0; // tidy up
+	leaf->map[nhead].run = 0;
 
 	return splitpoint;
 }
@@ -1120,7 +1875,8 @@ static u64 split_leaf(struct eleaf *leaf, struct eleaf *leaf2)
  * Merge the contents of 'leaf2' into 'leaf.'  The leaves are contiguous and
  * 'leaf2' follows 'leaf.'  Move the exception lists in 'leaf' up to make room
  * for those of 'leaf2,' adjusting the offsets in the map entries, then copy
- * the map entries and exception lists straight from 'leaf2.'
+ * the map entries and exception lists straight from 'leaf2.'  The runs on
+ * either side of the seam may join up again.
  */
 static void merge_leaves(struct eleaf *leaf, struct eleaf *leaf2)
 {
@@ -1139,6 +1895,8 @@ static void merge_leaves(struct eleaf *leaf, struct eleaf *leaf2)
 	memcpy(ptail - tailsize, (char *)emap(leaf2, 0), tailsize); // data
 	memcpy(&leaf->map[nhead], &leaf2->map[0], (ntail + 1) * sizeof(struct etree_map)); // map
 	leaf->count += ntail;
+	if (nhead)
+		join_runs(leaf, nhead - 1);
 }
 
 /*
@@ -1153,7 +1911,7 @@ static void merge_nodes(struct enode *node, struct enode *node2)
 static void init_leaf(struct eleaf *leaf, int block_size)
 {
 	leaf->magic = 0x1eaf;
-	leaf->version = 0;
+	leaf->version = LEAF_VERSION;
 	leaf->base_chunk = 0;
 	leaf->count = 0;
 	leaf->map[0].offset = block_size;
@@ -1173,6 +1931,8 @@ static void save_sb(struct superblock *sb)
 		if (diskwrite(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0)
 			warn("Unable to write superblock to disk: %s", strerror(errno));
 		sb->runflags &= ~RUN_SB_DIRTY;
+		sb->saved_root = sb->image.etree_root;
+		sb->saved_levels = sb->image.etree_levels;
 	}
 }
 
@@ -1252,7 +2012,7 @@ static int init_allocation(struct superblock *sb)
 	sb->metadata.asi->bitmap_base = meta_bitmap_base_chunk << sb->metadata.chunk_sectors_bits;
 	sb->metadata.asi->last_alloc = 0;
 
-	unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size;
+	unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size + sharing_blocks(sb);
 
 	/*
 	 * If we're using combined snapshot and metadata, we don't need to
@@ -1274,6 +2034,8 @@ static int init_allocation(struct superblock *sb)
 		+ ((sb->metadata.asi->bitmap_blocks +
 		    (!combined(sb) ? sb->snapdata.asi->bitmap_blocks : 0)) 
 		   << sb->metadata.chunk_sectors_bits);
+	sb->image.sharing_base = journal_sector(sb, sb->image.journal_size);
+	sb->image.flags |= SB_SHARING_BASE;
 	
 	if (!combined(sb))
 		warn("metadata store size: %Li chunks (%Li sectors)", 
@@ -1310,6 +2072,7 @@ static int free_chunk(struct superblock *sb, struct allocspace *as, chunk_t chun
 	}
 	clear_bitmap_bit(buffer->data, chunk & bitmap_mask);
 	brelse_dirty(buffer);
+	adjust_summary(alloc_summary(sb, as), bitmap_block, 1);
 	as->asi->freechunks++;
 	set_sb_dirty(sb); // !!! optimize this away
 	return 1;
@@ -1325,6 +2088,19 @@ static inline void free_exception(struct superblock *sb, chunk_t chunk)
 	free_chunk(sb, &sb->snapdata, chunk); // !!! why even have this?
 }
 
+/*
+ * Return whatever is left of the snapdata extent reserved for a write
+ * request.  Done before the request commits, so reserved chunks never
+ * reach the disk as allocated but unused.
+ */
+static void release_snapblocks(struct superblock *sb)
+{
+	while (sb->snap_extent.count) {
+		sb->snap_extent.count--;
+		free_exception(sb, sb->snap_extent.chunk++);
+	}
+}
+
 #ifdef INITDEBUG2
 static void grab_chunk(struct superblock *sb, struct allocspace *as, chunk_t chunk) // just for testing
 {
@@ -1335,6 +2111,7 @@ static void grab_chunk(struct superblock *sb, struct allocspace *as, chunk_t chu
 	assert(!get_bitmap_bit(buffer->data, chunk & bitmap_mask));
 	set_bitmap_bit(buffer->data, chunk & bitmap_mask);
 	brelse_dirty(buffer);
+	adjust_summary(alloc_summary(sb, as), bitmap_block, -1);
 }
 #endif
 
@@ -1353,6 +2130,21 @@ static int is_deferred_alloc(struct superblock *sb, chunk_t chunk)
 	return 0;
 }
 
+static int ranges_overlap(chunk_t chunk, unsigned count, struct alloc_range *range)
+{
+	return chunk < range->chunk + range->count && range->chunk < chunk + count;
+}
+
+static int overlaps_deferred_alloc(struct superblock *sb, chunk_t chunk, unsigned count)
+{
+	if (ranges_overlap(chunk, count, &sb->defer))
+		return 1;
+	for (int i = 0; i < sb->deferred_allocs; i++)
+		if (ranges_overlap(chunk, count, &sb->deferred_alloc[i]))
+			return 1;
+	return 0;
+}
+
 static void show_deferred_alloc(struct superblock *sb)
 {
 	unsigned count = sb->defer.count;
@@ -1374,6 +2166,9 @@ static void show_deferred_alloc(struct superblock *sb)
  * the end of the bitmap without finding a free chunk it starts over from the
  * beginning.  If it exhausts the range it's searching without finding a free
  * chunk, return failure.
+ *
+ * Bitmap blocks, and whole groups of them, that the free space summary says
+ * are full are stepped over without being read.
  */
 static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *as, chunk_t startchunk, chunk_t nchunks)
 {
@@ -1396,12 +2191,32 @@ static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *
 	unsigned bit = startchunk & 7;
 	u64 length = (nchunks + bit + 7) >> 3;
 
+	struct free_summary *summary = alloc_summary(sb, as);
+	u64 skip;
+
 	while (1) {
+		unsigned tail = sb->metadata.allocsize - offset, n = tail > length? length: tail;
+		if (summary && blocknum < summary->blocks) {
+			skip = summary->blocks - blocknum;
+			if (!offset && !(blocknum & (SUMMARY_GROUP - 1)) && !summary->group[blocknum >> SUMMARY_GROUP_BITS]) {
+				if (skip > SUMMARY_GROUP)
+					skip = SUMMARY_GROUP;
+				if (length <= skip << (bitmap_shift - 3))
+					return -1;
+				length -= skip << (bitmap_shift - 3);
+				goto next;
+			}
+			if (!summary->block[blocknum]) {
+				if (!(length -= n))
+					return -1;
+				skip = 1;
+				goto next;
+			}
+		}
 		struct buffer *buffer = snapread(sb, as->asi->bitmap_base + (blocknum << sb->metadata.chunk_sectors_bits));
 		if (!buffer)
 			return -1;
 		unsigned char c, *p = buffer->data + offset;
-		unsigned tail = sb->metadata.allocsize - offset, n = tail > length? length: tail;
 		trace(printf("search %u bytes of bitmap %Lx from offset %u\n", n, blocknum, offset););
 		for (length -= n; n--; p++)
 			if ((c = *p) != 0xff) {
@@ -1432,6 +2247,7 @@ static chunk_t alloc_chunk_from_range(struct superblock *sb, struct allocspace *
 						}
 						set_bitmap_bit(buffer->data, chunk & bitmap_mask);
 						set_buffer_dirty(buffer);
+						adjust_summary(summary, blocknum, -1);
 success:
 						brelse(buffer);
 						as->asi->freechunks--;
@@ -1447,6 +2263,11 @@ success:
 		if (++blocknum == as->asi->bitmap_blocks)
 			 blocknum = 0;
 		offset = 0;
+		continue;
+next:
+		if ((blocknum += skip) >= as->asi->bitmap_blocks)
+			 blocknum = 0;
+		offset = 0;
 		trace_off(printf("go to bitmap %Lx\n", blocknum););
 	}
 
@@ -1482,7 +2303,7 @@ static void brelse_path(struct etree_path *path, unsigned levels)
 static struct buffer *probe(struct superblock *sb, u64 chunk, struct etree_path *path)
 {
 	unsigned i, levels = sb->image.etree_levels;
-	struct buffer *nodebuf = snapread(sb, sb->image.etree_root);
+	struct buffer *nodebuf = read_node(sb, sb->image.etree_root, levels);
 	if (!nodebuf)
 		return NULL;
 	struct enode *node = buffer2node(nodebuf);
@@ -1496,7 +2317,10 @@ static struct buffer *probe(struct superblock *sb, u64 chunk, struct etree_path
 
 		path[i].buffer = nodebuf;
 		path[i].pnext = pnext;
-		nodebuf = snapread(sb, (pnext - 1)->sector);
+		if (i + 1 < levels)
+			nodebuf = read_node(sb, (pnext - 1)->sector, levels - i - 1);
+		else
+			nodebuf = snapread(sb, (pnext - 1)->sector);
 		if (!nodebuf) {
 			brelse_path(path, i);
 			return NULL;
@@ -1507,10 +2331,27 @@ static struct buffer *probe(struct superblock *sb, u64 chunk, struct etree_path
 	return nodebuf;
 }
 
+/*
+ * Leaf walks read the leaves under a node in index order, usually missing
+ * the cache on every one, so read the next READAHEAD_LEAVES of them in one
+ * batch whenever the walk gets to a leaf that isn't cached.
+ */
+static void readahead_leaves(struct superblock *sb, struct enode *node, struct index_entry *pnext)
+{
+	struct index_entry *top = node->entries + node->count;
+	sector_t sectors[READAHEAD_LEAVES];
+	unsigned n = 0;
+
+	while (pnext < top && n < READAHEAD_LEAVES)
+		sectors[n++] = pnext++->sector;
+	if (n > 1)
+		breadahead(sb->metadev, sectors, n, sb->metadata.allocsize);
+}
+
 /*
  * Stack-based inorder B-tree traversal.
  */
-static int traverse_tree_range(
+static int traverse_tree_range_(
 	struct superblock *sb, chunk_t start, chunk_t finish,
 	void (*visit_leaf)(struct superblock *sb, struct eleaf *leaf, void *data),
 	void *data)
@@ -1539,7 +2380,7 @@ static int traverse_tree_range(
 		 */
 		do {
 			level++;
-			nodebuf = snapread(sb, level? path[level - 1].pnext++->sector: sb->image.etree_root);
+			nodebuf = read_node(sb, level? path[level - 1].pnext++->sector: sb->image.etree_root, levels - level);
 			if (!nodebuf) {
 				warn("unable to read node at sector 0x%Lx at level %d of tree traversal",
 					level? path[level - 1].pnext++->sector: sb->image.etree_root, level);
@@ -1557,6 +2398,7 @@ static int traverse_tree_range(
 		 * for each.
 		 */
 		while (path[level].pnext < node->entries + node->count) {
+			readahead_leaves(sb, node, path[level].pnext);
 			leafbuf = snapread(sb, path[level].pnext++->sector);
 			if (!leafbuf) {
 				warn("unable to read leaf at sector 0x%Lx of tree traversal",
@@ -1585,6 +2427,153 @@ start:
 	}
 }
 
+/*
+ * Whole tree walks would otherwise flush the cache of the blocks that
+ * client I/O needs, so tell the buffer cache that these reads are a scan.
+ */
+static int traverse_tree_range(
+	struct superblock *sb, chunk_t start, chunk_t finish,
+	void (*visit_leaf)(struct superblock *sb, struct eleaf *leaf, void *data),
+	void *data)
+{
+	int scan = buffer_scan(1), err = traverse_tree_range_(sb, start, finish, visit_leaf, data);
+	buffer_scan(scan);
+	return err;
+}
+
+/*
+ * Btree cursor
+ *
+ * A cursor keeps the path to the leaf it last visited, so that a run of
+ * lookups on ascending chunks (one multi-chunk read or write request) pays
+ * for one descent from the root and then steps across the leaves in order,
+ * instead of probing from the root for every chunk.  The cursor holds a
+ * reference on its leaf and on each node of its path until released.
+ *
+ * Anything that changes the shape of the tree (a leaf or node split, a
+ * snapshot delete) invalidates the path, so such callers must release the
+ * cursor first; the next lookup will probe again from the root.
+ */
+
+struct etree_cursor
+{
+	struct superblock *sb;
+	struct buffer *leafbuf;
+	chunk_t start, limit; // range of chunks covered by the leaf in hand
+	unsigned levels;
+	struct etree_path path[MAX_ETREE_LEVELS];
+	int snapbit; // of the batched exceptions
+	unsigned batched; // new exceptions for the leaf in hand, not yet merged
+	struct new_exception batch[BATCH_EXCEPTIONS];
+};
+
+static void init_cursor(struct etree_cursor *cursor, struct superblock *sb)
+{
+	cursor->sb = sb;
+	cursor->leafbuf = NULL;
+	cursor->batched = 0;
+}
+
+static void release_cursor(struct etree_cursor *cursor)
+{
+	if (cursor->leafbuf) {
+		brelse(cursor->leafbuf);
+		brelse_path(cursor->path, cursor->levels);
+		cursor->leafbuf = NULL;
+	}
+}
+
+/*
+ * Work out which chunks the leaf at the end of the cursor path covers: from
+ * the key of the index entry we descended through (or the nearest ancestor
+ * entry that has one) up to the key of the next index entry at the lowest
+ * level that has one.
+ */
+static void cursor_bounds(struct etree_cursor *cursor)
+{
+	struct etree_path *path = cursor->path;
+	int level;
+
+	cursor->start = 0;
+	for (level = cursor->levels - 1; level >= 0; level--)
+		if (path[level].pnext - 1 > path_node(path, level)->entries) {
+			cursor->start = (path[level].pnext - 1)->key;
+			break;
+		}
+	cursor->limit = -1;
+	for (level = cursor->levels - 1; level >= 0; level--) {
+		struct enode *node = path_node(path, level);
+		if (path[level].pnext < node->entries + node->count) {
+			cursor->limit = path[level].pnext->key;
+			break;
+		}
+	}
+}
+
+/*
+ * Advance the cursor to the next leaf in key order, reusing as much of the
+ * path as possible: pop up to the lowest node that has a next entry, then
+ * descend along the leftmost edge from there.  Only called when the cursor
+ * limit is finite, so some level always has a next entry.
+ */
+static int cursor_next_leaf(struct etree_cursor *cursor)
+{
+	struct superblock *sb = cursor->sb;
+	struct etree_path *path = cursor->path;
+	int levels = cursor->levels, level = levels - 1;
+
+	brelse(cursor->leafbuf);
+	cursor->leafbuf = NULL;
+	while (path[level].pnext == path_node(path, level)->entries + path_node(path, level)->count)
+		brelse(path[level--].buffer);
+
+	sector_t sector = path[level].pnext++->sector;
+	while (1) {
+		struct buffer *buffer = level + 1 < levels? read_node(sb, sector, levels - level - 1): snapread(sb, sector);
+		if (!buffer) {
+			brelse_path(path, level + 1);
+			return -EIO;
+		}
+		if (++level == levels) {
+			cursor->leafbuf = buffer;
+			break;
+		}
+		path[level].buffer = buffer;
+		path[level].pnext = buffer2node(buffer)->entries + 1;
+		sector = buffer2node(buffer)->entries[0].sector;
+	}
+	assert(buffer2leaf(cursor->leafbuf)->magic == 0x1eaf);
+	cursor_bounds(cursor);
+	return 0;
+}
+
+/*
+ * Return the leaf that covers the given chunk, still held by the cursor.
+ * A chunk in the leaf already in hand costs nothing, a chunk in the next
+ * leaf costs one leaf read (plus whatever nodes are crossed) and anything
+ * else falls back to a fresh probe.
+ */
+static struct buffer *cursor_leaf(struct etree_cursor *cursor, chunk_t chunk)
+{
+	struct superblock *sb = cursor->sb;
+
+	if (cursor->leafbuf && chunk >= cursor->start) {
+		if (chunk < cursor->limit)
+			return cursor->leafbuf;
+		if (cursor->limit == -1 || cursor_next_leaf(cursor))
+			return NULL;
+		if (chunk < cursor->limit)
+			return cursor->leafbuf;
+	}
+	release_cursor(cursor);
+	cursor->levels = sb->image.etree_levels;
+	assert(cursor->levels < MAX_ETREE_LEVELS);
+	if (!(cursor->leafbuf = probe(sb, chunk, cursor->path)))
+		return NULL;
+	cursor_bounds(cursor);
+	return cursor->leafbuf;
+}
+
 /*
  * btree debug dump
  */
@@ -1592,9 +2581,12 @@ start:
 static void show_leaf_range(struct eleaf *leaf, chunk_t start, chunk_t finish)
 {
 	for (int i = 0; i < leaf->count; i++) {
-		chunk_t addr = leaf->map[i].rchunk;
-		if (addr >= start && addr <= finish) {
-			printf("Addr %Lu: ", (unsigned long long) addr);
+		chunk_t addr = leaf->map[i].rchunk, last = addr + leaf->map[i].run;
+		if (last >= start && addr <= finish) {
+			if (last > addr)
+				printf("Addr %Lu-%Lu: ", (unsigned long long) addr, (unsigned long long) last);
+			else
+				printf("Addr %Lu: ", (unsigned long long) addr);
 			for (struct exception *p = emap(leaf, i); p < emap(leaf, i+1); p++)
 				printf("%Lx/%08llx, ", p->chunk, p->share);
 			printf("\n");
@@ -1646,7 +2638,9 @@ static void check_leaf(struct eleaf *leaf, u64 snapmask)
 	int i;
 
 	for (i = 0; i < leaf->count; i++) {
-		trace(printf("%x=", leaf->map[i].rchunk););
+		trace(printf("%x+%x=", leaf->map[i].rchunk, leaf->map[i].run););
+		if (i && leaf->map[i].rchunk <= leaf->map[i-1].rchunk + leaf->map[i-1].run)
+			printf("run at %x overlaps the one before\n", leaf->map[i].rchunk);
 		// printf("@%i ", leaf->map[i].offset);
 		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
 			// !!! should also check for any zero sharemaps here
@@ -1724,11 +2718,15 @@ static void _delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *lea
 			dinfo->any |= share & dinfo->snapmask;
 					/* Unshare with given snapshot(s).    */
 			p->share &= ~dinfo->snapmask;
+			if ((share & dinfo->snapmask))
+				change_sharing(sb->sharing, share, p->share, run_chunks(leaf, i));
 			if (p->share)	/* If still used, keep chunk.         */
 				*--dest = *p;
 			else
-				free_exception(sb, p->chunk);
-			dirty_buffer_count_check(sb);
+				for (unsigned j = 0; j < run_chunks(leaf, i); j++) {
+					free_exception(sb, p->chunk + j);
+					dirty_buffer_count_check(sb);
+				}
 		}
 		leaf->map[i].offset = (char *)dest - (char *)leaf;
 	}
@@ -1749,7 +2747,12 @@ static void _delete_snapshots_from_leaf(struct superblock *sb, struct eleaf *lea
 	 */
 	dmap->offset = pmap->offset;
 	dmap->rchunk = 0; // tidy up
+	dmap->run = 0;
 	leaf->count = dmap - &leaf->map[0];
+	/* Runs that differed only in the deleted snapshots can join now */
+	for (i = 0; i + 1 < leaf->count;)
+		if (!join_runs(leaf, i))
+			i++;
 	check_leaf(leaf, dinfo->snapmask);
 }
 
@@ -1836,6 +2839,7 @@ static void remove_index(struct etree_path path[], int level)
  */
 static void brelse_free(struct superblock *sb, struct buffer *buffer)
 {
+	unpin_node(sb, buffer->sector);
 	brelse(buffer);
 	if (buffer->count) {
 		warn("free block %Lx still in use!", (long long)buffer->sector);
@@ -1858,7 +2862,7 @@ static void brelse_free(struct superblock *sb, struct buffer *buffer)
  * empty levels until either the second level is no longer empty or we only
  * have one level remaining.
  */
-static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume)
+static int delete_tree_range_(struct superblock *sb, u64 snapmask, chunk_t *resume, unsigned leaves)
 {
 	int levels = sb->image.etree_levels, level = levels - 1;
 	struct etree_path path[levels], hold[levels];
@@ -1867,11 +2871,13 @@ static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume
 
 	for (i = 0; i < levels; i++) // can be initializer if not dynamic array (change it?)
 		hold[i] = (struct etree_path){ };
+	/* Freed exceptions may be reallocated, so no copy may still be landing in one */
+	drain_copyouts(sb);
 	/*
 	 * Find the B-tree leaf with the chunk we were passed.  Often this
 	 * will be chunk 0.
 	 */
-	if (!(leafbuf = probe(sb, resume, path)))
+	if (!(leafbuf = probe(sb, *resume, path)))
 		return -ENOMEM;
 
 	commit_transaction(sb, 0);
@@ -1906,6 +2912,27 @@ static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t resume
 		}
 		prevleaf = leafbuf;	/* Save leaf for next time through.   */
 keep_prev_leaf:
+		/*
+		 * Out of leaves for this step?  Stop short of the next leaf
+		 * and let the caller resume from its index key, but only in
+		 * the middle of a node: the key of a first entry isn't kept,
+		 * and a finished node may still need merging with the one
+		 * before it.  Otherwise go on to the next leaf and try again.
+		 */
+		if (leaves && !--leaves) {
+			struct index_entry *pnext = path[level].pnext;
+			if (pnext > path_node(path, level)->entries && !finished_level(path, level)) {
+				*resume = pnext->key;
+				brelse(prevleaf);
+				for (i = 0; i < levels; i++)
+					if (hold[i].buffer)
+						brelse(hold[i].buffer);
+				brelse_path(path, levels);
+				commit_transaction(sb, 0);
+				return 1;
+			}
+			leaves = 1;
+		}
 		/*
 		 * If we've reached the end of the index entries in the B-tree
 		 * node at the current level, try to merge the node referred
@@ -1938,6 +2965,17 @@ keep_prev_leaf:
 					 */
 					if (this->count <= sb->metadata.alloc_per_node - prev->count) {
 						trace(warn(">>> can merge node %p into node %p", this, prev););
+						/*
+						 * The first key of this node is
+						 * about to become an interior key
+						 * but is not maintained, so set it
+						 * from the nearest ancestor entry.
+						 */
+						for (int up = level - 1; up >= 0; up--)
+							if (path[up].pnext - 1 > path_node(path, up)->entries) {
+								this->entries[0].key = (path[up].pnext - 1)->key;
+								break;
+							}
 						merge_nodes(prev, this);
 						remove_index(path, level - 1);
 						set_buffer_dirty(hold[level].buffer);
@@ -1975,7 +3013,7 @@ keep_prev_node:
 						brelse_free(sb, hold[0].buffer);
 						dirty_buffer_count_check(sb);
 						levels = --sb->image.etree_levels;
-						memcpy(hold, hold + 1, levels * sizeof(hold[0]));
+						memmove(hold, hold + 1, levels * sizeof(hold[0]));
 						set_sb_dirty(sb);
 					}
 					brelse(prevleaf);
@@ -1998,12 +3036,12 @@ keep_prev_node:
 			 * above the next leaf.
 			 */
 			do { /* push back down to leaf level */
-				struct buffer *nodebuf = snapread(sb, path[level++].pnext++->sector);
+				struct buffer *nodebuf = read_node(sb, path[level].pnext++->sector, levels - level - 1);
 				if (!nodebuf) {
-					brelse_path(path, level - 1); /* anything else needs to be freed? */
+					brelse_path(path, level); /* anything else needs to be freed? */
 					return -ENOMEM;
 				}
-				path[level].buffer = nodebuf;
+				path[++level].buffer = nodebuf;
 				path[level].pnext = buffer2node(nodebuf)->entries;
 				trace_off(printf("push to level %i, %i nodes\n", level, path_node(path, level)->count););
 			} while (level < levels - 1);
@@ -2014,6 +3052,7 @@ keep_prev_node:
 		 * Get the leaf indicated in the next index entry in the node
 		 * at this level.
 		 */
+		readahead_leaves(sb, path_node(path, level), path[level].pnext);
 		if (!(leafbuf = snapread(sb, path[level].pnext++->sector))) {
 			brelse_path(path, level);
 			return -ENOMEM;		
@@ -2021,6 +3060,56 @@ keep_prev_node:
 	}
 }
 
+static int delete_tree_range(struct superblock *sb, u64 snapmask, chunk_t *resume, unsigned leaves)
+{
+	int scan = buffer_scan(1), err = delete_tree_range_(sb, snapmask, resume, leaves);
+	buffer_scan(scan);
+	return err;
+}
+
+/*
+ * Background deletion
+ *
+ * Deleting a snapshot only takes it out of the snapshot list and marks its
+ * bit in sb->image.deleting, which keeps the bit from being reused while
+ * exceptions still carry it.  The server loop then clears deleted bits from
+ * the btree a few leaves at a time between client messages, one commit per
+ * step.  The chunk to go on from is kept in the superblock and goes to disk
+ * with the next superblock write, so a restart picks up from about where it
+ * left off; the delete itself only writes the superblock once it finishes.
+ * Walking leaves that are already clean costs a pass and nothing more, so
+ * queuing another bit while a delete is under way just starts the walk over.
+ */
+static void queue_delete(struct superblock *sb, u64 mask)
+{
+	sb->image.deleting |= mask;
+	sb->image.delete_resume = 0;
+	sb->snapmask &= ~mask;
+	set_sb_dirty(sb);
+}
+
+/* Delete from the next 'leaves' leaves, or from all the rest if zero */
+static int delete_step(struct superblock *sb, unsigned leaves)
+{
+	int err;
+
+	if (!sb->image.deleting)
+		return 0;
+	/* The exceptions we free must be marked in the bitmap */
+	if (sb->deferred_allocs || sb->defer.count)
+		commit_deferred_allocs(sb);
+	if ((err = delete_tree_range(sb, sb->image.deleting, &sb->image.delete_resume, leaves)) < 0)
+		return err;
+	set_sb_dirty(sb);
+	if (!err) {
+		trace_on(warn("finished deleting snapshot bits %Lx", (llu_t)sb->image.deleting););
+		sb->image.deleting = 0;
+		sb->image.delete_resume = 0;
+		save_sb(sb);
+	}
+	return 0;
+}
+
 /*
  * Find the given snapshot tag in the list of snapshots in the superblock.
  * Return a pointer to that snapshot entry.
@@ -2073,9 +3162,10 @@ static struct snapshot *find_victim(struct superblock *sb)
 }
 
 /*
- * Delete the passed snapshot.
+ * Take the passed snapshot out of the snapshot list.  Returns the bit its
+ * exceptions still carry, or zero if it was squashed and has none.
  */
-static int delete_snap(struct superblock *sb, struct snapshot *snap)
+static u64 unlist_snap(struct superblock *sb, struct snapshot *snap)
 {
 	trace_on(warn("Delete snaptag %u (snapnum %i)", snap->tag, snap->bit););
 	u64 mask;
@@ -2088,12 +3178,49 @@ static int delete_snap(struct superblock *sb, struct snapshot *snap)
 	/* Compress the snapshot entry out of the list. */
 	memmove(snap, snap + 1, (char *)(sb->image.snaplist + --sb->image.snapshots) - (char *)snap);
 	set_sb_dirty(sb);
+	return mask;
+}
+
+/*
+ * Delete the passed snapshot.
+ */
+static int delete_snap(struct superblock *sb, struct snapshot *snap)
+{
+	u64 mask = unlist_snap(sb, snap);
 	if (!mask) {
 		trace_on(warn("snapshot squashed, skipping tree delete"););
 		return 0;
 	}
-	commit_deferred_allocs(sb);
-	return delete_tree_range(sb, mask, 0);
+	queue_delete(sb, mask);
+	return 0;
+}
+
+/*
+ * Delete a list of snapshots together, so one pass over the btree clears
+ * all their bits.  Nothing is deleted unless every tag is valid.
+ */
+static int delete_snaps(struct superblock *sb, u32 *tags, unsigned count, char **why)
+{
+	struct snapshot *snap;
+	u64 mask = 0;
+
+	for (unsigned i = 0; i < count; i++) {
+		*why = "snapshot doesn't exist";
+		if (!(snap = find_snap(sb, tags[i])))
+			return -EINVAL;
+		*why = "snapshot has non-zero usecount";
+		if (usecount(sb, snap))
+			return -EINVAL;
+		*why = "snapshot listed twice";
+		for (unsigned j = 0; j < i; j++)
+			if (tags[j] == tags[i])
+				return -EINVAL;
+	}
+	for (unsigned i = 0; i < count; i++)
+		mask |= unlist_snap(sb, find_snap(sb, tags[i]));
+	if (mask)
+		queue_delete(sb, mask);
+	return 0;
 }
 
 /*
@@ -2123,27 +3250,116 @@ static chunk_t alloc_chunk(struct superblock *sb, struct allocspace *as)
 }
 
 /*
- * Both alloc_metablock() and alloc_snapblock() call alloc_chunk() to allocate
- * a chunk.  The new_block() function calls alloc_metablock() to allocate a
- * block from the metadata allocation, then calls getblk() to allocate a
- * buffer for that block.  Both new_leaf() and new_node() call new_block()
- * for their buffer.  The chunk allocation functions here return either the
- * newly-allocated chunk number or -1 if the allocation failed.
- * new_block() returns NULL for failure.
+ * Allocate a run of up to 'want' contiguous chunks.
  *
- * Note that alloc_metablock() is only called here.  alloc_snapblock() is
- * called elsewhere (make_unique()) to allocate snapshot blocks.
+ * Like alloc_chunk() this searches from the last allocation onward with
+ * wrap, a bitmap block at a time, taking the first run of the full length.
+ * Runs do not cross bitmap blocks.  The free space summary lets us pass
+ * over blocks too full to hold a longer run than we already have, and we
+ * give up looking for the full length after EXTENT_SEARCH_BLOCKS blocks
+ * so a fragmented store costs no more than a few block reads.  Returns the
+ * first chunk of the longest run found and its length in *got, or -1 if
+ * there was no run of at least two chunks; the caller can still allocate
+ * single chunks with alloc_chunk().
  */
-static chunk_t alloc_metablock(struct superblock *sb)
+static chunk_t alloc_extent(struct superblock *sb, struct allocspace *as, unsigned want, unsigned *got)
 {
-	return alloc_chunk(sb, &sb->metadata);
-}
-
-static u64 alloc_snapblock(struct superblock *sb)
+	const unsigned bitmap_shift = sb->metadata.asi->allocsize_bits + 3;
+	const unsigned bits = 1 << bitmap_shift;
+	struct free_summary *summary = alloc_summary(sb, as);
+	chunk_t total = as->asi->chunks, last = as->asi->last_alloc, found = -1;
+	u64 blocks = as->asi->bitmap_blocks, blocknum = last >> bitmap_shift;
+	unsigned bit = last & (bits - 1), searched = 0, best = 1;
+
+	for (u64 n = 0; n <= blocks && best < want && searched < EXTENT_SEARCH_BLOCKS; n++, bit = 0) {
+		chunk_t base = blocknum << bitmap_shift;
+		unsigned limit = total - base < bits ? total - base : bits, run = 0;
+
+		if (summary && blocknum < summary->blocks && summary->block[blocknum] <= best)
+			goto next;
+		struct buffer *buffer = snapread(sb, as->asi->bitmap_base + (blocknum << sb->metadata.chunk_sectors_bits));
+		if (!buffer)
+			break;
+		searched++;
+		for (unsigned i = bit; i <= limit; i++) {
+			unsigned end = i;
+			if (i < limit && !get_bitmap_bit(buffer->data, i)) {
+				if (++run < want)
+					continue;
+				end = i + 1;
+			} else if (i < limit && !(i & 7) && i + 8 <= limit && buffer->data[i >> 3] == 0xff)
+				i += 7;
+			if (run > best && !overlaps_deferred_alloc(sb, base + end - run, run)) {
+				found = base + end - run;
+				if ((best = run) == want)
+					break;
+			}
+			run = 0;
+		}
+		brelse(buffer);
+next:
+		if (++blocknum == blocks)
+			blocknum = 0;
+	}
+	if (found == -1)
+		return -1;
+	trace(warn("allocate %u chunks at %Lx", best, found););
+	change_bits(sb, found, best, as->asi->bitmap_base << SECTOR_BITS, 1);
+	as->asi->freechunks -= best;
+	as->asi->last_alloc = found + best - 1;
+	set_sb_dirty(sb);
+	*got = best;
+	return found;
+}
+
+/*
+ * Both alloc_metablock() and alloc_snapblock() call alloc_chunk() to allocate
+ * a chunk.  The new_block() function calls alloc_metablock() to allocate a
+ * block from the metadata allocation, then calls getblk() to allocate a
+ * buffer for that block.  Both new_leaf() and new_node() call new_block()
+ * for their buffer.  The chunk allocation functions here return either the
+ * newly-allocated chunk number or -1 if the allocation failed.
+ * new_block() returns NULL for failure.
+ *
+ * Note that alloc_metablock() is only called here.  alloc_snapblock() is
+ * called elsewhere (make_unique()) to allocate snapshot blocks, and takes
+ * them from the extent reserved by reserve_snapblocks() while there is one.
+ */
+static chunk_t alloc_metablock(struct superblock *sb)
+{
+	return alloc_chunk(sb, &sb->metadata);
+}
+
+static u64 alloc_snapblock(struct superblock *sb)
 {
+	if (sb->snap_extent.count) {
+		sb->snap_extent.count--;
+		return sb->snap_extent.chunk++;
+	}
 	return alloc_chunk(sb, &sb->snapdata);
 }
 
+/*
+ * Reserve a contiguous extent of snapdata for the rest of a write range, so
+ * its copyouts land on consecutive exceptions and copyout() can merge them
+ * into a single copy of up to copybuf_size.  Combined stores keep back the
+ * metadata chunks make_unique() promised the btree.
+ */
+static void reserve_snapblocks(struct superblock *sb, unsigned chunks)
+{
+	chunk_t avail = sb->snapdata.asi->freechunks, keep = combined(sb)? MAX_NEW_METACHUNKS: 0, chunk;
+	unsigned got, max = sb->copybuf_size >> sb->snapdata.asi->allocsize_bits;
+
+	if (chunks > max)
+		chunks = max;
+	if (avail < keep + chunks)
+		chunks = avail > keep? avail - keep: 0;
+	if (chunks < 2 || sb->snap_extent.count)
+		return;
+	if ((chunk = alloc_extent(sb, &sb->snapdata, chunks, &got)) != -1)
+		sb->snap_extent = (struct alloc_range){ .chunk = chunk, .count = got };
+}
+
 static struct buffer *new_block(struct superblock *sb)
 {
 	chunk_t newchunk;
@@ -2219,13 +3435,15 @@ static void gen_changelist_leaf(struct superblock *sb, struct eleaf *leaf, void
 	for (i = 0; i < leaf->count; i++)
 		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
 			if ( ((p->share & mask2) == mask2) != ((p->share & mask1) == mask1) ) {
-				newchunk = leaf->base_chunk + leaf->map[i].rchunk;
-				/* check if the chunk is within the size of the target snapshot
-				 * to deal with origin device shrinking */
-				if ((newchunk << sb->snapdata.chunk_sectors_bits) >= snap_sectors)
-					continue;
-				if (append_change_list(cl, newchunk) < 0)
-					warn("unable to write chunk %Li to changelist", newchunk);
+				for (unsigned j = 0; j < run_chunks(leaf, i); j++) {
+					newchunk = leaf->base_chunk + leaf->map[i].rchunk + j;
+					/* check if the chunk is within the size of the target snapshot
+					 * to deal with origin device shrinking */
+					if ((newchunk << sb->snapdata.chunk_sectors_bits) >= snap_sectors)
+						break;
+					if (append_change_list(cl, newchunk) < 0)
+						warn("unable to write chunk %Li to changelist", newchunk);
+				}
 				break;
 			}
 		}
@@ -2270,48 +3488,14 @@ static void insert_child(struct enode *node, struct index_entry *p, sector_t chi
 }
 
 /*
- * Add an exception to the B-tree.
- *
- * This routine calls add_exception_to_leaf() to add the passed exception to
- * the leaf.  If that fails, we split the leaf and add the exception to the
- * appropriate leaf of the pair.  We then add the new leaf to the enode,
- * splitting it (and any parents) if necessary.  In the degenerate case, we
- * split enodes all the way up the etree path until we create a new root at
- * the top.
- *
- * Returns 0 on success and -errno on failure.
+ * Add a new child block, which starts at childkey, to the tree next to the
+ * block at the end of the path: insert it in the parent after the path
+ * entry, splitting the parent (and any parents) if necessary.  In the
+ * degenerate case, we split enodes all the way up the path until we
+ * create a new root at the top.
  */
-static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf, u64 target, u64 exception, int snapbit, struct etree_path path[], unsigned levels)
+static int add_child_to_tree(struct superblock *sb, sector_t childsector, u64 childkey, struct etree_path path[], unsigned levels)
 {
-	/*
-	 * Try to add the exception to the leaf we already have in hand.  If
-	 * that works, we're done.
-	 */
-	if (!add_exception_to_leaf(buffer2leaf(leafbuf), target, exception, snapbit, sb->snapmask)) {
-		brelse_dirty(leafbuf);
-		return 0;
-	}
-	/*
-	 * There wasn't room to add a new exception to the leaf.  Split it.
-	 */
-	trace(warn("adding a new leaf to the tree"););
-	struct buffer *childbuf = new_leaf(sb);
-	if (!childbuf) 
-		return -ENOMEM; /* this is the right thing to do? */
-	
-	u64 childkey = split_leaf(buffer2leaf(leafbuf), buffer2leaf(childbuf));
-	sector_t childsector = childbuf->sector;
-	/*
-	 * Now add the exception to the appropriate leaf.  Childkey has the
-	 * first chunk in the new leaf we just created.
-	 */
-	if (add_exception_to_leaf(target < childkey ? buffer2leaf(leafbuf): buffer2leaf(childbuf), target, exception, snapbit, sb->snapmask)) {
-		warn("new leaf has no space");
-		return -ENOMEM;
-	}
-	brelse_dirty(leafbuf);
-	brelse_dirty(childbuf);
-
 	while (levels--) {
 		struct index_entry *pnext = path[levels].pnext;
 		struct buffer *parentbuf = path[levels].buffer;
@@ -2383,128 +3567,973 @@ static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf,
 	return 0;
 }
 
+/*
+ * Add an exception to the B-tree.
+ *
+ * This routine calls add_exception_to_leaf() to add the passed exception to
+ * the leaf.  If that fails, we split the leaf and add the exception to the
+ * appropriate leaf of the pair.  We then add the new leaf to the tree with
+ * add_child_to_tree().
+ *
+ * The caller keeps its reference to the leaf, which is left dirty.  Returns
+ * 0 if the exception went into that leaf, 1 if the tree had to be split (so
+ * the path no longer describes the leaf in hand) and -errno on failure.
+ * Cutting a chunk out of a run can need more room than one split frees, in
+ * which case the split is kept and -EAGAIN asks the caller to probe again
+ * and retry on the smaller leaf.
+ */
+static int add_exception_to_tree(struct superblock *sb, struct buffer *leafbuf, u64 target, u64 exception, int snapbit, struct etree_path path[], unsigned levels)
+{
+	/*
+	 * Try to add the exception to the leaf we already have in hand.  If
+	 * that works, we're done.
+	 */
+	if (!add_exception_to_leaf(buffer2leaf(leafbuf), target, exception, snapbit, sb->snapmask, sb->sharing)) {
+		set_buffer_dirty(leafbuf);
+		return 0;
+	}
+	/*
+	 * There wasn't room to add a new exception to the leaf.  Split it.
+	 */
+	trace(warn("adding a new leaf to the tree"););
+	struct buffer *childbuf = new_leaf(sb);
+	if (!childbuf) 
+		return -ENOMEM; /* this is the right thing to do? */
+	
+	u64 childkey = split_leaf(buffer2leaf(leafbuf), buffer2leaf(childbuf));
+	sector_t childsector = childbuf->sector;
+	int ret = 1, err;
+	/*
+	 * Now add the exception to the appropriate leaf.  Childkey has the
+	 * first chunk in the new leaf we just created.
+	 */
+	struct eleaf *leaf = target < childkey ? buffer2leaf(leafbuf): buffer2leaf(childbuf);
+	if (add_exception_to_leaf(leaf, target, exception, snapbit, sb->snapmask, sb->sharing)) {
+		if (leaf->count > 1 || leaf->map[0].run)
+			ret = -EAGAIN;
+		else {
+			warn("new leaf has no space");
+			ret = -ENOMEM;
+		}
+	}
+	set_buffer_dirty(leafbuf);
+	brelse_dirty(childbuf);
+	if ((err = add_child_to_tree(sb, childsector, childkey, path, levels)))
+		return err;
+	return ret;
+}
+
 #define chunk_highbit ((sizeof(chunk_t) * 8) - 1)
 
 /*
- * Actually perform a "copyout" operation.
- *
- * If a copyout operation is pending (as set up by copyout(), below), this
- * routine actually does the copy via calls to diskread() and diskwrite().
+ * Asynchronous copyout
+ *
+ * With a copyout depth set, finish_copyout() hands each copy to a free slot
+ * of a small pool and returns at once.  The slot reads the source chunks
+ * into its own buffer and, when that completes, writes them to the new
+ * exception.  Copies for several requests, and the reads and writes of
+ * different copies, overlap with each other and with the server carrying
+ * on.  Nothing may depend on a copy before it is done:
+ *
+ *  - commit_transaction() waits for all copies in flight, so no exception
+ *    reaches the journal before its data.  Write replies are held for the
+ *    next commit (see group commit), so no client overwrites the source of
+ *    a copy before it has been read.
+ *
+ *  - A snapshot read that lands on an exception still being written, or a
+ *    copy from such an exception, waits for that copy.
+ *
+ *  - Snapshot delete waits for all copies, because it may free exceptions
+ *    that would otherwise be reallocated under a copy still in flight.
+ */
+
+struct copyout
+{
+	struct async_io io;
+	struct superblock *sb;
+	chunk_t exception; // destination, while busy
+	unsigned chunks;
+	int busy;
+};
+
+static int setup_copyouts(struct superblock *sb)
+{
+	int err;
+
+	if (!(sb->copyouts = calloc(sb->copyout_depth, sizeof(struct copyout))))
+		return -ENOMEM;
+	for (int i = 0; i < sb->copyout_depth; i++) {
+		struct copyout *copy = sb->copyouts + i;
+		copy->sb = sb;
+		copy->io.private = copy;
+		if ((err = posix_memalign(&copy->io.data, SECTOR_SIZE, sb->copybuf_size)))
+			return -err;
+	}
+	return 0;
+}
+
+static void copyout_written(struct async_io *io)
+{
+	struct copyout *copy = io->private;
+
+	if (io->result < 0 && io->write)
+		warn("copyout death on write: %s", strerror(-io->result));
+	copy->busy = 0;
+	copy->sb->copyouts_busy--;
+}
+
+static void copyout_read(struct async_io *io)
+{
+	struct copyout *copy = io->private;
+	struct superblock *sb = copy->sb;
+	int err;
+
+	if (io->result < 0) {
+		trace(printf("copyout death on read\n"););
+		copyout_written(io);
+		return;
+	}
+	io->fd = sb->snapdev;
+	io->write = 1;
+	io->offset = copy->exception << sb->snapdata.asi->allocsize_bits;
+	io->done = copyout_written;
+	if ((err = async_submit(io)) < 0) {
+		io->result = err;
+		copyout_written(io);
+	}
+}
+
+static int copyout_busy(struct superblock *sb, chunk_t chunk, unsigned chunks)
+{
+	for (int i = 0; i < sb->copyout_depth; i++) {
+		struct copyout *copy = sb->copyouts + i;
+		if (copy->busy && chunk < copy->exception + copy->chunks && copy->exception < chunk + chunks)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Wait until no copy in flight is writing any of the given snapshot store
+ * chunks.
+ */
+static void wait_copyouts(struct superblock *sb, chunk_t chunk, unsigned chunks)
+{
+	while (sb->copyouts_busy && copyout_busy(sb, chunk, chunks))
+		async_reap(1);
+}
+
+static void drain_copyouts(struct superblock *sb)
+{
+	while (sb->copyouts_busy)
+		async_reap(1);
+}
+
+static void submit_copyout(struct superblock *sb, int is_snap, chunk_t source, chunk_t exception, unsigned chunks)
+{
+	unsigned bits = sb->snapdata.asi->allocsize_bits;
+	struct copyout *copy;
+	int err;
+
+	if (is_snap)
+		wait_copyouts(sb, source, chunks);
+	while (sb->copyouts_busy == sb->copyout_depth)
+		async_reap(1);
+	for (copy = sb->copyouts; copy->busy; copy++)
+		;
+	copy->busy = 1;
+	sb->copyouts_busy++;
+	copy->exception = exception;
+	copy->chunks = chunks;
+	copy->io.fd = is_snap? sb->snapdev: sb->orgdev;
+	copy->io.write = 0;
+	copy->io.count = chunks << bits;
+	copy->io.offset = source << bits;
+	copy->io.done = copyout_read;
+	if ((err = async_submit(&copy->io)) < 0) {
+		warn("unable to start copyout: %s", strerror(-err));
+		copy->io.result = err;
+		copyout_written(&copy->io);
+	}
+}
+
+
+/*
+ * Actually perform a "copyout" operation.
+ *
+ * If a copyout operation is pending (as set up by copyout(), below), this
+ * routine actually does the copy via calls to diskread() and diskwrite().
+ */
+static int finish_copyout(struct superblock *sb)
+{
+	if (sb->copy_chunks) {
+		int is_snap = sb->source_chunk >> chunk_highbit;
+		chunk_t source = sb->source_chunk & ~(1ULL << chunk_highbit);
+		unsigned size = sb->copy_chunks << sb->snapdata.asi->allocsize_bits;
+		trace(printf("copy %u %schunks from %Lx to %Lx\n", sb->copy_chunks,
+			is_snap? "snapshot ": "origin ", source, sb->dest_exception););
+		assert(size <= sb->copybuf_size);
+		if (sb->copyout_depth)
+			submit_copyout(sb, is_snap, source, sb->dest_exception, sb->copy_chunks);
+		else if (diskread(is_snap? sb->snapdev: sb->orgdev, sb->copybuf, size,
+			source << sb->snapdata.asi->allocsize_bits) < 0)
+			trace(printf("copyout death on read\n"););
+		else if (diskwrite(sb->snapdev, sb->copybuf, size,
+			sb->dest_exception << sb->snapdata.asi->allocsize_bits) < 0)
+			trace_on(printf("copyout death on write\n"););
+		sb->copy_chunks = 0;
+	}
+	return 0;
+}
+
+/*
+ * Handle the "copyout" operation.
+ *
+ * When a shared chunk is changed, the original contents must be copied from
+ * the origin or from the snapshot in which it changed to (a new location in)
+ * the snapshot store before the change takes place.  This routine stores the
+ * latest such operation in the superblock.  As an optimization, it also
+ * accumulates consecutive chunks so that they may be copied together.
+ */
+static int copyout(struct superblock *sb, chunk_t chunk, chunk_t exception)
+{
+#if 1
+	/*
+	 * If this is the next consecutive chunk, it's mapped to the next
+	 * consecutive snapshot chunk _and_ it will fit in the copy buffer,
+	 * just bump the count; we'll copy the whole set together.
+	 */
+	if (sb->source_chunk + sb->copy_chunks == chunk &&
+		sb->dest_exception + sb->copy_chunks == exception &&
+		sb->copy_chunks < sb->copybuf_size >> sb->snapdata.asi->allocsize_bits) {
+		sb->copy_chunks++;
+		return 0;
+	}
+	/*
+	 * If there's a pending copyout and this one doesn't meet the above
+	 * criteria, perform the previous copyout and start a new one.
+	 */
+	finish_copyout(sb);
+	sb->copy_chunks = 1;
+	sb->source_chunk = chunk;
+	sb->dest_exception = exception;
+#else
+	int is_snap = sb->source_chunk >> chunk_highbit;
+	chunk_t source = chunk & ~((1ULL << chunk_highbit) - 1);
+	diskread(is_snap? sb->snapdev: sb->orgdev, sb->copybuf, sb->snapdata.allocsize, 
+		 source << sb->snapdata.asi->allocsize_bits);  
+	diskwrite(sb->snapdev, sb->copybuf, sb->snapdata.allocsize, exception << sb->snapdata.asi->allocsize_bits);  
+#endif
+	return 0;
+}
+
+/*
+ * Select a victim snapshot and delete/squash it. Called when the snapshot 
+ * store is full or when we reach the maximum number of snapshots.
+ */
+static int auto_delete_snapshot(struct superblock *sb)
+{
+	struct snapshot *victim = find_victim(sb);
+	int err;
+	if (is_squashed(victim) || victim->prio == 127) {
+		/* All snapshots deleted, check for lost chunks */
+		if (sb->image.snapdata.freechunks < sb->image.snapdata.chunks ) {
+			warn("%Li free data chunks after all snapshots deleted", sb->image.snapdata.freechunks);
+			sb->image.snapdata.freechunks = count_free(sb, &sb->snapdata);
+		}
+		if (!combined(sb)) {
+			/* reserved meta data + bitmap_blocks + super_block */
+			// !!! this is also used in initialization, make this a common function
+			unsigned meta_bitmap_base_chunk = (SB_SECTOR + 2*chunk_sectors(&sb->metadata) - 1) >> sb->metadata.chunk_sectors_bits;
+			unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size
+				+ sb->metadata.asi->bitmap_blocks + 1
+				+ sb->snapdata.asi->bitmap_blocks;
+			if (sb->image.metadata.freechunks + reserved < sb->image.metadata.chunks) {
+				warn("%Li free metadata chunks after all snapshots deleted", sb->image.metadata.freechunks);
+				sb->image.metadata.freechunks = count_free(sb, &sb->metadata);
+			}
+		}
+		return -1;
+	}
+	warn("releasing snapshot %u", victim->tag);
+	if (usecount(sb, victim)) {
+		queue_delete(sb, 1ULL << victim->bit);
+		sb->usecount[victim->bit] = 0;
+		victim->bit = SNAPSHOT_SQUASHED;
+		err = 0;
+	} else
+		err = delete_snap(sb, victim);
+	return err;
+}
+
+static int ensure_free_chunks(struct superblock *sb, struct allocspace *as, int chunks)
+{
+	/* Space held by snapshots already being deleted comes back first */
+	while (as->asi->freechunks < chunks) {
+		if (sb->image.deleting) {
+			if (delete_step(sb, 0))
+				goto fail_delete;
+			continue;
+		}
+		if (!sb->image.snapshots || auto_delete_snapshot(sb))
+			goto fail_delete;
+	}
+	return 0;
+
+fail_delete:
+	warn("snapshot delete failed");
+	return -1;
+}
+
+/*
+ * Origin uniqueness cache
+ *
+ * Once every live snapshot has an exception for an origin chunk, later origin
+ * writes to that chunk never need a copyout, but finding that out still means
+ * reading the leaf.  Remember such chunks in a sparse two level bitmap: a
+ * directory of bitmap pages, each covering UNIQUE_PAGE_CHUNKS chunks and
+ * allocated on first use.  A page that fills up is freed and remembered by
+ * its count alone.  The set only holds for the current snapmask: adding a
+ * snapshot discards all of it, while deleting one leaves it valid.
+ */
+
+#define UNIQUE_PAGE_BITS 15
+#define UNIQUE_PAGE_CHUNKS (1U << UNIQUE_PAGE_BITS)
+#define UNIQUE_MAX_PAGES (1U << 14) // 64 MB of bitmap at most
+
+static int unique_origin_chunk(struct superblock *sb, chunk_t chunk)
+{
+	struct unique_set *set = &sb->unique;
+	chunk_t index = chunk >> UNIQUE_PAGE_BITS;
+	unsigned bit = chunk & (UNIQUE_PAGE_CHUNKS - 1);
+
+	if (index >= set->pages || !set->count[index])
+		return 0;
+	if (set->count[index] == UNIQUE_PAGE_CHUNKS)
+		return 1;
+	return get_bitmap_bit(set->page[index], bit);
+}
+
+static void set_unique_origin_chunk(struct superblock *sb, chunk_t chunk)
+{
+	struct unique_set *set = &sb->unique;
+	chunk_t index = chunk >> UNIQUE_PAGE_BITS;
+	unsigned bit = chunk & (UNIQUE_PAGE_CHUNKS - 1);
+
+	if (index >= set->pages) {
+		unsigned pages = set->pages? set->pages: 64;
+		while (pages <= index)
+			pages *= 2;
+		unsigned char **page = realloc(set->page, pages * sizeof(*page));
+		unsigned *count = realloc(set->count, pages * sizeof(*count));
+		if (page)
+			set->page = page;
+		if (count)
+			set->count = count;
+		if (!page || !count)
+			return;
+		memset(set->page + set->pages, 0, (pages - set->pages) * sizeof(*page));
+		memset(set->count + set->pages, 0, (pages - set->pages) * sizeof(*count));
+		set->pages = pages;
+	}
+	if (set->count[index] == UNIQUE_PAGE_CHUNKS)
+		return;
+	if (!set->page[index]) {
+		if (set->used == UNIQUE_MAX_PAGES)
+			return;
+		if (!(set->page[index] = calloc(1, UNIQUE_PAGE_CHUNKS >> 3)))
+			return;
+		set->used++;
+	}
+	if (get_bitmap_bit(set->page[index], bit))
+		return;
+	set_bitmap_bit(set->page[index], bit);
+	if (++set->count[index] == UNIQUE_PAGE_CHUNKS) {
+		free(set->page[index]);
+		set->page[index] = NULL;
+		set->used--;
+	}
+}
+
+static void clear_unique_origin_chunks(struct superblock *sb)
+{
+	struct unique_set *set = &sb->unique;
+
+	for (unsigned i = 0; i < set->pages; i++) {
+		free(set->page[i]);
+		set->page[i] = NULL;
+		set->count[i] = 0;
+	}
+	set->used = 0;
+}
+
+/*
+ * Merge count batched exceptions into the leaf in hand, which covers all
+ * their chunks.  If the result doesn't fit the block, do as a B*tree does:
+ * share it out with a sibling leaf under the same parent, the next one if
+ * there is one, else the previous.  If that would leave the pair nearly
+ * full, split the pair three ways instead, each leaf about two thirds full,
+ * and add the new leaf to the tree.  Without a sibling, split in two.  The
+ * leaves are balanced on payload bytes.  Anything but a plain merge
+ * releases the cursor, since its bounds or path no longer describe the
+ * leaf.  Returns -EFULL if the result would take more than one new leaf.
+ */
+static int merge_exceptions(struct etree_cursor *cursor, struct new_exception *batch, unsigned count)
+{
+	struct superblock *sb = cursor->sb;
+	struct eleaf *leaf = buffer2leaf(cursor->leafbuf);
+	unsigned top = leaf->map[leaf->count].offset, parts = 1, cut[4], i;
+	unsigned max_maps = 3 * top / (sizeof(struct etree_map) + sizeof(struct exception));
+	unsigned max_exceptions = 3 * top / sizeof(struct exception);
+	struct etree_map map[max_maps + 1];
+	struct exception ex[max_exceptions];
+	struct leaf_build b = { .map = map, .ex = ex, .max_maps = max_maps, .max_exceptions = max_exceptions };
+	struct etree_path *parent = cursor->levels? cursor->path + cursor->levels - 1: NULL;
+	struct buffer *bufs[3] = { cursor->leafbuf }, *sibbuf = NULL, *newbuf = NULL;
+	struct index_entry *second = NULL; // parent entry of the second leaf of a pair
+	int err = -EFULL;
+
+	if (build_leaf(&b, leaf, batch, count, cursor->snapbit, sb->snapmask))
+		return -EFULL;
+	if (built_size(&b, 0, b.maps) <= top)
+		goto account;
+	if (parent) {
+		struct enode *node = buffer2node(parent->buffer);
+
+		if (parent->pnext < node->entries + node->count) {
+			second = parent->pnext;
+			if (!(sibbuf = snapread(sb, second->sector)))
+				return -EIO;
+			bufs[1] = sibbuf;
+			if (build_sibling(&b, buffer2leaf(sibbuf)))
+				goto out;
+		} else if (parent->pnext - 1 > node->entries) {
+			second = parent->pnext - 1;
+			if (!(sibbuf = snapread(sb, (second - 1)->sector)))
+				return -EIO;
+			bufs[0] = sibbuf;
+			bufs[1] = cursor->leafbuf;
+			b.maps = b.exceptions = 0;
+			if (build_sibling(&b, buffer2leaf(sibbuf)) ||
+			    build_leaf(&b, leaf, batch, count, cursor->snapbit, sb->snapmask))
+				goto out;
+		}
+	}
+	/* Shift into the sibling only while that leaves both an eighth free */
+	if (second && !cut_build(&b, 2, top - top / 8, cut))
+		parts = 2;
+	else if (second && !cut_build(&b, 3, top, cut))
+		parts = 3;
+	else if (!second && !cut_build(&b, 2, top, cut))
+		parts = 2;
+	else
+		goto out;
+	if (parts == (second? 3: 2)) {
+		trace(warn("adding a new leaf to the tree"););
+		if (!(newbuf = new_leaf(sb))) {
+			err = -ENOMEM;
+			goto out;
+		}
+		bufs[parts - 1] = newbuf;
+	}
+account:
+	for (i = 0; i < count; i++) {
+		if (batch[i].unshared)
+			change_sharing(sb->sharing, batch[i].unshared, batch[i].unshared & ~(1ULL << cursor->snapbit), 1);
+		account_sharing(sb->sharing, batch[i].share, 1);
+	}
+	if (parts == 1) {
+		write_leaf(leaf, &b, 0, b.maps, top);
+		set_buffer_dirty(cursor->leafbuf);
+		return 0;
+	}
+	for (i = 0; i < parts; i++) {
+		buffer2leaf(bufs[i])->base_chunk = leaf->base_chunk;
+		write_leaf(buffer2leaf(bufs[i]), &b, cut[i], cut[i + 1], top);
+		set_buffer_dirty(bufs[i]);
+	}
+	if (second) {
+		second->key = b.map[cut[1]].rchunk + leaf->base_chunk;
+		set_buffer_dirty(parent->buffer);
+		parent->pnext = second + 1;
+	}
+	err = 0;
+	if (newbuf) {
+		u64 childkey = b.map[cut[parts - 1]].rchunk + leaf->base_chunk;
+		sector_t childsector = newbuf->sector;
+		brelse(newbuf);
+		err = add_child_to_tree(sb, childsector, childkey, cursor->path, cursor->levels);
+	}
+	release_cursor(cursor);
+out:
+	if (sibbuf)
+		brelse(sibbuf);
+	return err;
+}
+
+/*
+ * Add the exceptions batched by make_unique() to the tree: the whole batch
+ * in one merge if it fits, else in smaller pieces, and as a last resort
+ * one at a time through add_exception_to_tree().
+ */
+static int flush_exceptions(struct etree_cursor *cursor)
+{
+	struct superblock *sb = cursor->sb;
+	struct new_exception *batch = cursor->batch;
+	unsigned count = cursor->batched, done = 0, n;
+	int err = 0;
+
+	cursor->batched = 0;
+	while (done < count) {
+		chunk_t chunk = batch[done].chunk;
+		struct buffer *leafbuf = cursor_leaf(cursor, chunk);
+		if (!leafbuf) {
+			err = -ENOMEM;
+			break;
+		}
+		for (n = 1; done + n < count && batch[done + n].chunk < cursor->limit; n++)
+			;
+		while ((err = merge_exceptions(cursor, batch + done, n)) == -EFULL && n > 1)
+			n = (n + 1) / 2;
+		if (err == -EFULL) {
+			while ((err = add_exception_to_tree(sb, leafbuf, chunk, batch[done].exception, cursor->snapbit, cursor->path, cursor->levels)) == -EAGAIN) {
+				release_cursor(cursor);
+				if (!(leafbuf = cursor_leaf(cursor, chunk))) {
+					err = -ENOMEM;
+					break;
+				}
+			}
+			if (err)
+				release_cursor(cursor);
+			if (err == 1)
+				err = 0;
+		}
+		if (err)
+			break;
+		done += n;
+	}
+	if (err) {
+		warn("unable to add exception to tree: %s", strerror(-err));
+		for (; done < count; done++)
+			free_exception(sb, batch[done].exception);
+		if (cursor->snapbit == -1)
+			clear_unique_origin_chunks(sb);
+	}
+	return err;
+}
+
+/*
+ * Bulk loading
+ *
+ * Build a tree bottom up from a stream of (chunk, exception, share) tuples
+ * sorted by chunk, the exceptions for one chunk in list order.  Each leaf
+ * is filled to the brim, written out and added to the index node above,
+ * which goes to the node above it when full, and so on up to a new root.
+ * Blocks come from extents of the metadata allocation, so the leaves land
+ * on disk in key order.  They are written directly, not journalled, since
+ * nothing points at them until the superblock takes the new root; until
+ * then a crash only loses the allocation, which was never committed.
+ */
+#define BULK_EXTENT 64
+
+struct bulk_load
+{
+	struct superblock *sb;
+	struct leaf_build leaf; // the leaf being filled
+	unsigned top, levels;
+	struct enode *node[MAX_ETREE_LEVELS]; // the node being filled at each level
+	chunk_t chunk; // whose exceptions are being gathered
+	unsigned count;
+	struct exception list[MAX_SNAPSHOTS];
+	chunk_t extent;
+	unsigned extent_left;
+	chunk_t *blocks; // allocated so far, to back out on failure
+	unsigned allocated, max_blocks, leaves;
+	sector_t root;
+	int err;
+};
+
+static int bulk_start(struct bulk_load *bulk, struct superblock *sb)
+{
+	unsigned top;
+
+	*bulk = (struct bulk_load){ .sb = sb, .chunk = -1 };
+	/* Leaves are as big as init_leaf() makes them */
+	struct eleaf *leaf = malloc(sb->metadata.allocsize);
+	if (!leaf)
+		return -ENOMEM;
+	init_leaf(leaf, sb->metadata.allocsize);
+	top = bulk->top = leaf->map[0].offset;
+	free(leaf);
+	bulk->leaf.max_maps = top / sizeof(struct etree_map);
+	bulk->leaf.max_exceptions = top / sizeof(struct exception) + MAX_SNAPSHOTS;
+	bulk->leaf.map = malloc((bulk->leaf.max_maps + 1) * sizeof(struct etree_map));
+	bulk->leaf.ex = malloc(bulk->leaf.max_exceptions * sizeof(struct exception));
+	if (!bulk->leaf.map || !bulk->leaf.ex)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Let go of the leftovers, and of everything allocated if the load failed */
+static void bulk_end(struct bulk_load *bulk, int failed)
+{
+	struct superblock *sb = bulk->sb;
+	unsigned i;
+
+	while (bulk->extent_left--)
+		free_chunk(sb, &sb->metadata, bulk->extent++);
+	if (failed)
+		for (i = 0; i < bulk->allocated; i++)
+			free_chunk(sb, &sb->metadata, bulk->blocks[i]);
+	for (i = 0; i < bulk->levels; i++)
+		free(bulk->node[i]);
+	free(bulk->leaf.map);
+	free(bulk->leaf.ex);
+	free(bulk->blocks);
+}
+
+/* Write a block out to the next metadata chunk */
+static int bulk_write(struct bulk_load *bulk, void *data, sector_t *sector)
+{
+	struct superblock *sb = bulk->sb;
+	struct buffer *buffer;
+	chunk_t chunk;
+
+	if (bulk->allocated == bulk->max_blocks) {
+		unsigned max = bulk->max_blocks? 2 * bulk->max_blocks: 1024;
+		chunk_t *blocks = realloc(bulk->blocks, max * sizeof(chunk_t));
+		if (!blocks)
+			return -ENOMEM;
+		bulk->blocks = blocks;
+		bulk->max_blocks = max;
+	}
+	if (!bulk->extent_left) {
+		/* Leave the reserve that make_unique() counts on */
+		if (sb->metadata.asi->freechunks <= MAX_NEW_METACHUNKS)
+			return -ENOSPC;
+		if ((bulk->extent = alloc_extent(sb, &sb->metadata, BULK_EXTENT, &bulk->extent_left)) == -1) {
+			if ((bulk->extent = alloc_metablock(sb)) == -1)
+				return -ENOSPC;
+			bulk->extent_left = 1;
+		}
+	}
+	chunk = bulk->blocks[bulk->allocated++] = bulk->extent++;
+	bulk->extent_left--;
+	if (!(buffer = getblk(sb->metadev, chunk << sb->metadata.chunk_sectors_bits, sb->metadata.allocsize)))
+		return -ENOMEM;
+	memcpy(buffer->data, data, sb->metadata.allocsize);
+	if (write_buffer(buffer)) {
+		brelse(buffer);
+		return -EIO;
+	}
+	brelse(buffer);
+	*sector = chunk << sb->metadata.chunk_sectors_bits;
+	return 0;
+}
+
+/* Add a child to the node being filled at this level, writing it out first if full */
+static int bulk_add_child(struct bulk_load *bulk, unsigned level, u64 key, sector_t child)
+{
+	struct superblock *sb = bulk->sb;
+	struct enode *node;
+
+	if (level == bulk->levels) {
+		if (level == MAX_ETREE_LEVELS - 1)
+			return -EFBIG;
+		if (!(bulk->node[level] = calloc(1, sb->metadata.allocsize)))
+			return -ENOMEM;
+		bulk->levels++;
+	}
+	node = bulk->node[level];
+	if (node->count == sb->metadata.alloc_per_node) {
+		sector_t sector;
+		int err;
+
+		if ((err = bulk_write(bulk, node, &sector)) ||
+		    (err = bulk_add_child(bulk, level + 1, node->entries[0].key, sector)))
+			return err;
+		memset(node, 0, sb->metadata.allocsize);
+	}
+	node->entries[node->count++] = (struct index_entry){ .key = key, .sector = child };
+	return 0;
+}
+
+/* Write out the leaf being filled with its first 'maps' runs */
+static int bulk_write_leaf(struct bulk_load *bulk, unsigned maps)
+{
+	struct superblock *sb = bulk->sb;
+	struct leaf_build *b = &bulk->leaf;
+	char data[sb->metadata.allocsize];
+	struct eleaf *leaf = (struct eleaf *)data;
+	sector_t sector;
+	int err;
+
+	memset(data, 0, sb->metadata.allocsize);
+	init_leaf(leaf, sb->metadata.allocsize);
+	write_leaf(leaf, b, 0, maps, bulk->top);
+	if ((err = bulk_write(bulk, data, &sector)))
+		return err;
+	bulk->leaves++;
+	return bulk_add_child(bulk, 0, maps? b->map[0].rchunk: 0, sector);
+}
+
+/* The gathered exceptions for a chunk become a run of one, joined to the last if it can */
+static int bulk_end_chunk(struct bulk_load *bulk)
+{
+	struct leaf_build *b = &bulk->leaf;
+	struct exception *p;
+	int err;
+
+	if (!bulk->count)
+		return 0;
+	if (!(p = open_run(b, bulk->chunk, 1, bulk->count)))
+		return -EFULL;
+	memcpy(p, bulk->list, bulk->count * sizeof(struct exception));
+	close_run(b);
+	b->map[b->maps].offset = b->exceptions;
+	bulk->count = 0;
+	if (built_size(b, 0, b->maps) <= bulk->top)
+		return 0;
+	/* It didn't fit: write out the rest and start the next leaf with it */
+	struct etree_map last = b->map[b->maps - 1];
+	unsigned count = b->exceptions - last.offset;
+
+	if (b->maps == 1)
+		return -EFBIG;
+	if ((err = bulk_write_leaf(bulk, b->maps - 1)))
+		return err;
+	memmove(b->ex, b->ex + last.offset, count * sizeof(struct exception));
+	last.offset = 0;
+	b->map[0] = last;
+	b->map[1].offset = b->exceptions = count;
+	b->maps = 1;
+	return 0;
+}
+
+static int bulk_add(struct bulk_load *bulk, chunk_t chunk, chunk_t exception, u64 share)
+{
+	if (bulk->err)
+		return bulk->err;
+	if (chunk != bulk->chunk) {
+		if (bulk->chunk != -1 && chunk < bulk->chunk)
+			return bulk->err = -EINVAL;
+		if ((bulk->err = bulk_end_chunk(bulk)))
+			return bulk->err;
+		bulk->chunk = chunk;
+	}
+	if (!share || chunk >> 32 || bulk->count == MAX_SNAPSHOTS)
+		return bulk->err = -EINVAL;
+	bulk->list[bulk->count++] = (struct exception){ .share = share, .chunk = exception };
+	return 0;
+}
+
+/* Write out what is left at each level, the top node being the new root */
+static int bulk_finish(struct bulk_load *bulk)
+{
+	unsigned level;
+	int err;
+
+	if (bulk->err || (err = bulk_end_chunk(bulk)))
+		return bulk->err? bulk->err: err;
+	if ((bulk->leaf.maps || !bulk->leaves) && (err = bulk_write_leaf(bulk, bulk->leaf.maps)))
+		return err;
+	for (level = 0; level < bulk->levels; level++) {
+		sector_t sector;
+
+		if ((err = bulk_write(bulk, bulk->node[level], &sector)))
+			return err;
+		if (level == bulk->levels - 1)
+			bulk->root = sector;
+		else if ((err = bulk_add_child(bulk, level + 1, bulk->node[level]->entries[0].key, sector)))
+			return err;
+	}
+	return 0;
+}
+
+static void bulk_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
+{
+	struct exception *p;
+	unsigned i, j;
+
+	for (i = 0; i < leaf->count; i++)
+		for (j = 0; j < run_chunks(leaf, i); j++)
+			for (p = emap(leaf, i); p < emap(leaf, i+1); p++)
+				bulk_add(data, leaf->base_chunk + leaf->map[i].rchunk + j, p->chunk + j, p->share);
+}
+
+/* Free every block of a tree, returning how many there were */
+static u64 free_tree(struct superblock *sb, sector_t sector, unsigned levels)
+{
+	struct buffer *buffer = snapread(sb, sector);
+	struct enode *node;
+	u64 blocks = 1;
+
+	if (!buffer) {
+		warn("unable to read node at sector 0x%Lx, leaking its subtree", (llu_t)sector);
+		return 0;
+	}
+	node = buffer2node(buffer);
+	for (unsigned i = 0; i < node->count; i++)
+		if (levels > 1)
+			blocks += free_tree(sb, node->entries[i].sector, levels - 1);
+		else {
+			free_block(sb, node->entries[i].sector);
+			blocks++;
+		}
+	brelse(buffer);
+	unpin_node(sb, sector);
+	free_block(sb, sector);
+	return blocks;
+}
+
+/*
+ * Switch the superblock to a bulk loaded tree, then free the old one.  The
+ * new tree's blocks are committed as allocated before the superblock points
+ * at them, and the old tree's are only freed once it no longer does, so a
+ * crash in between leaks a tree rather than freeing one still in use.
+ */
+static u64 replace_tree(struct superblock *sb, struct bulk_load *bulk)
+{
+	sector_t oldroot = sb->image.etree_root;
+	unsigned oldlevels = sb->image.etree_levels;
+
+	bulk_end(bulk, 0);
+	commit_transaction(sb, 1);
+	sb->image.etree_root = bulk->root;
+	sb->image.etree_levels = bulk->levels;
+	set_sb_dirty(sb);
+	save_sb(sb);
+	u64 blocks = free_tree(sb, oldroot, oldlevels);
+	commit_transaction(sb, 1);
+	return blocks;
+}
+
+/*
+ * Rebuild the exception tree packed, by bulk loading it from a walk of
+ * the old one, then free the old one.
  */
-static int finish_copyout(struct superblock *sb)
+static int compact_tree(struct superblock *sb, u64 *before, u64 *after)
 {
-	if (sb->copy_chunks) {
-		int is_snap = sb->source_chunk >> chunk_highbit;
-		chunk_t source = sb->source_chunk & ~(1ULL << chunk_highbit);
-		unsigned size = sb->copy_chunks << sb->snapdata.asi->allocsize_bits;
-		trace(printf("copy %u %schunks from %Lx to %Lx\n", sb->copy_chunks,
-			is_snap? "snapshot ": "origin ", source, sb->dest_exception););
-		assert(size <= sb->copybuf_size);
-		if (diskread(is_snap? sb->snapdev: sb->orgdev, sb->copybuf, size,
-			source << sb->snapdata.asi->allocsize_bits) < 0)
-			trace(printf("copyout death on read\n"););
-		if (diskwrite(sb->snapdev, sb->copybuf, size,
-			sb->dest_exception << sb->snapdata.asi->allocsize_bits) < 0)
-			trace_on(printf("copyout death on write\n"););
-		sb->copy_chunks = 0;
+	unsigned oldlevels = sb->image.etree_levels;
+	struct bulk_load bulk;
+	int err;
+
+	while (sb->image.deleting)
+		if ((err = delete_step(sb, 0)))
+			return err;
+	/* Nothing journalled before this may be replayed over the new blocks */
+	commit_deferred_allocs(sb);
+	if ((err = bulk_start(&bulk, sb)) ||
+	    (err = traverse_tree_range(sb, 0, -1, bulk_leaf, &bulk)) ||
+	    (err = bulk_finish(&bulk))) {
+		warn("unable to rebuild tree: %s", strerror(-err));
+		bulk_end(&bulk, 1);
+		return err;
 	}
+	*after = bulk.allocated;
+	*before = replace_tree(sb, &bulk);
+	trace_on(warn("rebuilt tree: %u levels, %Lu blocks, was %u levels, %Lu blocks",
+		sb->image.etree_levels, (llu_t)*after, oldlevels, (llu_t)*before););
 	return 0;
 }
 
-/*
- * Handle the "copyout" operation.
- *
- * When a shared chunk is changed, the original contents must be copied from
- * the origin or from the snapshot in which it changed to (a new location in)
- * the snapshot store before the change takes place.  This routine stores the
- * latest such operation in the superblock.  As an optimization, it also
- * accumulates consecutive chunks so that they may be copied together.
- */
-static int copyout(struct superblock *sb, chunk_t chunk, chunk_t exception)
+static void count_leaf(struct superblock *sb, struct eleaf *leaf, void *data)
 {
-#if 1
-	/*
-	 * If this is the next consecutive chunk, it's mapped to the next
-	 * consecutive snapshot chunk _and_ it will fit in the copy buffer,
-	 * just bump the count; we'll copy the whole set together.
-	 */
-	if (sb->source_chunk + sb->copy_chunks == chunk &&
-		sb->dest_exception + sb->copy_chunks == exception &&
-		sb->copy_chunks < sb->copybuf_size >> sb->snapdata.asi->allocsize_bits) {
-		sb->copy_chunks++;
-		return 0;
-	}
-	/*
-	 * If there's a pending copyout and this one doesn't meet the above
-	 * criteria, perform the previous copyout and start a new one.
-	 */
-	finish_copyout(sb);
-	sb->copy_chunks = 1;
-	sb->source_chunk = chunk;
-	sb->dest_exception = exception;
-#else
-	int is_snap = sb->source_chunk >> chunk_highbit;
-	chunk_t source = chunk & ~((1ULL << chunk_highbit) - 1);
-	diskread(is_snap? sb->snapdev: sb->orgdev, sb->copybuf, sb->snapdata.allocsize, 
-		 source << sb->snapdata.asi->allocsize_bits);  
-	diskwrite(sb->snapdev, sb->copybuf, sb->snapdata.allocsize, exception << sb->snapdata.asi->allocsize_bits);  
-#endif
+	*(u64 *)data += leaf->count;
+}
+
+/* Mark an imported exception's snapshot chunk allocated, if it is free */
+static int claim_exception(struct superblock *sb, chunk_t chunk)
+{
+	chunk_t base = sb->snapdata.asi->bitmap_base << SECTOR_BITS;
+
+	if (chunk >= sb->snapdata.asi->chunks || change_bits(sb, chunk, 1, base, 0))
+		return -EINVAL;
+	change_bits(sb, chunk, 1, base, 1);
+	sb->snapdata.asi->freechunks--;
+	set_sb_dirty(sb);
 	return 0;
 }
 
+static void unclaim_exceptions(struct superblock *sb, FILE *tuples, u64 count)
+{
+	struct exception_tuple tuple;
+
+	rewind(tuples);
+	while (count-- && fread(&tuple, sizeof(tuple), 1, tuples) == 1)
+		free_chunk(sb, &sb->snapdata, tuple.exception);
+}
+
 /*
- * Select a victim snapshot and delete/squash it. Called when the snapshot 
- * store is full or when we reach the maximum number of snapshots.
+ * Seed an empty tree with exceptions from a file of tuples sorted by
+ * origin chunk, for instance those of another store.  The first pass
+ * checks each tuple and claims its snapshot chunk, the second bulk loads
+ * the tree from them.  Share masks are snapshot bits, so the snapshots
+ * must already exist.
  */
-static int auto_delete_snapshot(struct superblock *sb)
+static int import_tree(struct superblock *sb, FILE *tuples, u64 *count)
 {
-	struct snapshot *victim = find_victim(sb);
+	struct exception_tuple tuple;
+	struct bulk_load bulk;
+	chunk_t last = 0;
+	u64 have = 0;
 	int err;
-	if (is_squashed(victim) || victim->prio == 127) {
-		/* All snapshots deleted, check for lost chunks */
-		if (sb->image.snapdata.freechunks < sb->image.snapdata.chunks ) {
-			warn("%Li free data chunks after all snapshots deleted", sb->image.snapdata.freechunks);
-			sb->image.snapdata.freechunks = count_free(sb, &sb->snapdata);
+
+	*count = 0;
+	if ((err = traverse_tree_range(sb, 0, -1, count_leaf, &have)))
+		return err;
+	if (have || sb->image.deleting) {
+		warn("tree has %Lu leaf runs, import only into an empty one", (llu_t)have);
+		return -EEXIST;
+	}
+	while (fread(&tuple, sizeof(tuple), 1, tuples) == 1) {
+		if (!tuple.share || tuple.share & ~sb->snapmask || tuple.chunk >> 32 ||
+		    (*count && tuple.chunk < last)) {
+			warn("bad tuple %Lu: chunk %Lu, share %016Lx", (llu_t)*count,
+				(llu_t)tuple.chunk, (llu_t)tuple.share);
+			err = -EINVAL;
+			goto unclaim;
 		}
-		if (!combined(sb)) {
-			/* reserved meta data + bitmap_blocks + super_block */
-			// !!! this is also used in initialization, make this a common function
-			unsigned meta_bitmap_base_chunk = (SB_SECTOR + 2*chunk_sectors(&sb->metadata) - 1) >> sb->metadata.chunk_sectors_bits;
-			unsigned reserved = meta_bitmap_base_chunk + sb->metadata.asi->bitmap_blocks + sb->image.journal_size
-				+ sb->metadata.asi->bitmap_blocks + 1
-				+ sb->snapdata.asi->bitmap_blocks;
-			if (sb->image.metadata.freechunks + reserved < sb->image.metadata.chunks) {
-				warn("%Li free metadata chunks after all snapshots deleted", sb->image.metadata.freechunks);
-				sb->image.metadata.freechunks = count_free(sb, &sb->metadata);
-			}
+		if ((err = claim_exception(sb, tuple.exception))) {
+			warn("tuple %Lu: exception %Lu is not a free snapshot chunk",
+				(llu_t)*count, (llu_t)tuple.exception);
+			goto unclaim;
 		}
-		return -1;
+		last = tuple.chunk;
+		++*count;
 	}
-	warn("releasing snapshot %u", victim->tag);
-	if (usecount(sb, victim)) {
-		commit_deferred_allocs(sb);
-		err = delete_tree_range(sb, 1ULL << victim->bit, 0);
-		sb->usecount[victim->bit] = 0;
-		victim->bit = SNAPSHOT_SQUASHED;
-	} else
-		err = delete_snap(sb, victim);
+	if (ferror(tuples)) {
+		err = -EIO;
+		goto unclaim;
+	}
+	commit_deferred_allocs(sb);
+	rewind(tuples);
+	if ((err = bulk_start(&bulk, sb)))
+		goto fail;
+	for (u64 i = 0; i < *count; i++) {
+		if (fread(&tuple, sizeof(tuple), 1, tuples) != 1 ||
+		    bulk_add(&bulk, tuple.chunk, tuple.exception, tuple.share)) {
+			err = bulk.err? bulk.err: -EIO;
+			goto fail;
+		}
+		account_sharing(sb->sharing, tuple.share, 1);
+	}
+	if ((err = bulk_finish(&bulk)))
+		goto fail;
+	replace_tree(sb, &bulk);
+	trace_on(warn("imported %Lu exceptions: %u levels, %u blocks",
+		(llu_t)*count, sb->image.etree_levels, bulk.allocated););
+	return 0;
+fail:
+	warn("unable to import tree: %s", strerror(-err));
+	bulk_end(&bulk, 1);
+	memset(sb->sharing, 0, sizeof(sb->sharing)); // the tree was empty
+unclaim:
+	unclaim_exceptions(sb, tuples, *count);
+	*count = 0;
 	return err;
 }
 
-static int ensure_free_chunks(struct superblock *sb, struct allocspace *as, int chunks)
-{
-	do {
-		if (as->asi->freechunks >= chunks)
-			return 0;
-		if (auto_delete_snapshot(sb))
-			goto fail_delete;
-	} while (sb->image.snapshots);
-
-fail_delete:
-	warn("snapshot delete failed");
-	return -1;
-}
-
 /*
  * This is the bit that does all the work.  It's rather arbitrarily
  * factored into a probe and test part, then an exception add part,
@@ -2519,31 +4548,57 @@ fail_delete:
  * that task.  It returns zero if no copies took place (that is, "exceptions"
  * for this chunk already existed for all snapshots), nonzero otherwise.  A
  * return of -1 indicates an error that caused make_unique() to fail.
+ *
+ * 'run' is the number of chunks left in the write range, this one included.
+ * The first copyout of a range reserves that many snapdata chunks (up to a
+ * copy buffer full) in one extent; the caller calls release_snapblocks()
+ * when done with the request.
+ *
+ * The new exception is only queued on the cursor, so the caller also calls
+ * flush_exceptions() before it lets go of the cursor.
  */
-static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
+static chunk_t make_unique(struct superblock *sb, struct etree_cursor *cursor, chunk_t chunk, int snapbit, unsigned run)
 {
 	chunk_t exception = 0;
-	int error;
 	trace(warn("chunk %Lx, snapbit %i", chunk, snapbit););
 
+	if (snapbit == -1 && unique_origin_chunk(sb, chunk))
+		return 0;
+
 	/* first we check if we will have enough freespace */
-	if (combined(sb)) {
-		if (ensure_free_chunks(sb, &sb->metadata, MAX_NEW_METACHUNKS + 1))
-			return -1;
-	} else { /* separate */
-		if (ensure_free_chunks(sb, &sb->metadata, MAX_NEW_METACHUNKS))
-			return -1;
-		if (ensure_free_chunks(sb, &sb->snapdata, 1))
+	if (combined(sb)?
+		sb->metadata.asi->freechunks < MAX_NEW_METACHUNKS + 1:
+		sb->metadata.asi->freechunks < MAX_NEW_METACHUNKS || sb->snapdata.asi->freechunks < 1) {
+		/* auto delete will reshape the tree under the cursor */
+		if (cursor->batched && flush_exceptions(cursor))
 			return -1;
+		release_cursor(cursor);
+		release_snapblocks(sb);
+		if (combined(sb)) {
+			if (ensure_free_chunks(sb, &sb->metadata, MAX_NEW_METACHUNKS + 1))
+				return -1;
+		} else { /* separate */
+			if (ensure_free_chunks(sb, &sb->metadata, MAX_NEW_METACHUNKS))
+				return -1;
+			if (ensure_free_chunks(sb, &sb->snapdata, 1))
+				return -1;
+		}
 	}
 
-	unsigned levels = sb->image.etree_levels;
-	struct etree_path path[levels + 1];
 	/*
-	 * Find the proper leaf for this chunk.  The "path" gets the list of
+	 * New exceptions are batched up for the leaf in hand, in chunk order,
+	 * so merge the batch before moving on.
+	 */
+	if (cursor->batched && (cursor->batched == BATCH_EXCEPTIONS || snapbit != cursor->snapbit ||
+	    chunk <= cursor->batch[cursor->batched - 1].chunk || chunk >= cursor->limit))
+		if (flush_exceptions(cursor))
+			return -1;
+
+	/*
+	 * Find the proper leaf for this chunk.  The cursor keeps the list of
 	 * B-tree nodes that lead to the returned leaf.
 	 */
-	struct buffer *leafbuf = probe(sb, chunk, path);
+	struct buffer *leafbuf = cursor_leaf(cursor, chunk);
 	if (!leafbuf) 
 		return -1;
 
@@ -2556,9 +4611,12 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 		snapshot_chunk_unique(buffer2leaf(leafbuf), chunk, snapbit, &exception))
 	{
 		trace_off(warn("chunk %Lx already unique in snapnum %i", chunk, snapbit););
-		brelse(leafbuf);
+		if (snapbit == -1)
+			set_unique_origin_chunk(sb, chunk);
 		goto out;
 	}
+	if (run > 1)
+		reserve_snapblocks(sb, run);
 	u64 newex = alloc_snapblock(sb);
 	if (newex == -1) {
 		// count_free
@@ -2566,15 +4624,12 @@ static chunk_t make_unique(struct superblock *sb, chunk_t chunk, int snapbit)
 	}; /* if this broke, then our ensure above is broken */
 
 	copyout(sb, exception? (exception | (1ULL << chunk_highbit)): chunk, newex);
-	if ((error = add_exception_to_tree(sb, leafbuf, chunk, newex, snapbit, path, levels)) < 0) {
-		free_exception(sb, newex);
-		brelse(leafbuf); /* !!! redundant? */
-		warn("unable to add exception to tree: %s", strerror(-error));
-		newex = -1;
-	}
+	cursor->snapbit = snapbit;
+	cursor->batch[cursor->batched++] = (struct new_exception){ .chunk = chunk, .exception = newex };
+	if (snapbit == -1)
+		set_unique_origin_chunk(sb, chunk);
 	exception = newex;
 out:
-	brelse_path(path, levels);
 	trace(warn("returning exception: %Lx", exception););
 	return exception;
 }
@@ -2583,22 +4638,17 @@ out:
  * Find the chunk in the b-tree corresponding to the passed chunk and return
  * an indication of whether or not it is shared.
  */
-static int test_unique(struct superblock *sb, chunk_t chunk, int snapbit, chunk_t *exception)
+static int test_unique(struct superblock *sb, struct etree_cursor *cursor, chunk_t chunk, int snapbit, chunk_t *exception)
 {
-	unsigned levels = sb->image.etree_levels;
-	struct etree_path path[levels + 1];
-	struct buffer *leafbuf = probe(sb, chunk, path);
+	struct buffer *leafbuf = cursor_leaf(cursor, chunk);
 	
 	if (!leafbuf)
 		return -1; /* not sure what to do here */
 	
 	trace(warn("chunk %Lx, snapbit %i", chunk, snapbit););
-	int result = snapbit == -1?
+	return snapbit == -1?
 		origin_chunk_unique(buffer2leaf(leafbuf), chunk, sb->snapmask):
 		snapshot_chunk_unique(buffer2leaf(leafbuf), chunk, snapbit, exception);
-	brelse(leafbuf);
-	brelse_path(path, levels);
-	return result;
 }
 
 /* Snapshot Store Superblock handling */
@@ -2677,10 +4727,13 @@ static int create_snapshot(struct superblock *sb, unsigned snaptag)
 	if (find_snap(sb, snaptag))
 		return -EEXIST;
 
-	/* Find available snapshot bit */
+	/* Find available snapshot bit, finishing any delete to free one */
+again:
 	for (i = 0; i < MAX_SNAPSHOTS; i++)
-		if (!(sb->snapmask & (1ULL << i)))
+		if (!((sb->snapmask | sb->image.deleting) & (1ULL << i)))
 			goto create;
+	if (sb->image.deleting && !delete_step(sb, 0))
+		goto again;
 	return -EFULL;
 
 create:
@@ -2688,6 +4741,7 @@ create:
 	snapshot = sb->image.snaplist + sb->image.snapshots++;
 	*snapshot = (struct snapshot){ .tag = snaptag, .bit = i, .ctime = time(NULL), .sectors = sb->image.orgsectors };
 	sb->snapmask |= (1ULL << i);
+	clear_unique_origin_chunks(sb);
 	set_sb_dirty(sb);
 	return i;
 }
@@ -2711,12 +4765,6 @@ static void show_snapshots(struct superblock *sb)
 
 /* Lock snapshot reads against origin writes */
 
-static void reply(int sock, struct messagebuf *message) // !!! bad name choice, make this send_reply
-{
-	trace(warn("%x/%u", message->head.code, message->head.length););
-	writepipe(sock, &message->head, message->head.length + sizeof(message->head));
-}
-
 #define SNAPCLIENT_BIT 1
 
 struct client
@@ -2725,8 +4773,246 @@ struct client
 	int sock;
 	int snaptag;
 	u32 flags; 
+	struct list_head list; // all connected clients
+	struct list_head ready; // clients with input not yet read, or empty
+	char *ring; // receive ring, CLIENT_RING bytes, or NULL to read directly
+	unsigned ring_head, ring_tail; // free running, received and taken
+	char *out; // replies queued, not yet sent
+	unsigned out_len, out_sent, out_size;
+	struct list_head replying; // on sb->replying while replies wait to go out, or empty
+	int writable_wait; // socket was full, flush again when epoll says writable
+	int hangup; // peer hung up, read on to end of file
+};
+
+/*
+ * Receive ring
+ *
+ * Each client connection reads into a ring buffer, taking whatever the
+ * socket has queued with one nonblocking read, then every complete message
+ * in the ring is handled before going back to the socket.  A burst of
+ * queries from a busy client thus costs one read, not two per message.
+ * The socket itself stays blocking, for replies.  The agent connection has
+ * no ring and reads each message straight from its socket.
+ */
+#define CLIENT_RING (1 << 13) // a power of two, and room for the longest message
+
+static unsigned ring_used(struct client *client)
+{
+	return client->ring_head - client->ring_tail;
+}
+
+static void ring_copy(struct client *client, void *data, unsigned count)
+{
+	unsigned at = client->ring_tail & (CLIENT_RING - 1), first = CLIENT_RING - at;
+
+	if (first > count)
+		first = count;
+	memcpy(data, client->ring + at, first);
+	memcpy(data + first, client->ring, count - first);
+}
+
+/* Take the next count bytes of the message stream */
+static int client_read(struct client *client, void *data, unsigned count)
+{
+	if (!client->ring)
+		return readpipe(client->sock, data, count);
+	if (ring_used(client) < count)
+		return -EPIPE;
+	ring_copy(client, data, count);
+	client->ring_tail += count;
+	return 0;
+}
+
+/* Is there a whole message in the ring, or at least a head too long to take? */
+static int message_ready(struct client *client)
+{
+	struct head head;
+
+	if (ring_used(client) < sizeof(head))
+		return 0;
+	ring_copy(client, &head, sizeof(head));
+	return head.length > maxbody || ring_used(client) >= sizeof(head) + head.length;
+}
+
+/*
+ * Read as much as the socket has, up to the room in the ring.  Returns the
+ * bytes read, zero at end of file, or -errno, -EAGAIN if there was nothing.
+ */
+static int fill_ring(struct client *client)
+{
+	unsigned at = client->ring_head & (CLIENT_RING - 1), room = CLIENT_RING - ring_used(client);
+	struct iovec iov[2] = {
+		{ .iov_base = client->ring + at, .iov_len = CLIENT_RING - at < room? CLIENT_RING - at: room },
+		{ .iov_base = client->ring, .iov_len = CLIENT_RING - at < room? room - (CLIENT_RING - at): 0 } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iov[1].iov_len? 2: 1 };
+	int n;
+
+	while ((n = recvmsg(client->sock, &msg, MSG_DONTWAIT)) == -1 && errno == EINTR)
+		;
+	if (n < 0)
+		return -errno;
+	client->ring_head += n;
+	return n;
+}
+
+/*
+ * Reply queue
+ *
+ * Replies to clients are appended to a per-client output buffer instead of
+ * written one by one, and the event loop sends each client's buffer with a
+ * single nonblocking send at the end of the dispatch round, so the two
+ * answers to a snapshot read and the replies to a burst of queries all go
+ * out together.  Whatever the socket won't take waits for epoll to say it
+ * is writable, without holding up the loop.  A client that stops reading
+ * altogether only gets so far ahead: past OUT_LIMIT we wait for the socket
+ * as replies always used to.  Replies that are written directly to the
+ * socket rather than queued must flush the queue first to keep the order.
+ */
+#define OUT_LIMIT (1 << 20)
+
+/* Send what is queued, returning -EAGAIN if the socket is full */
+static int flush_replies(struct client *client)
+{
+	while (client->out_sent < client->out_len) {
+		int n = send(client->sock, client->out + client->out_sent, client->out_len - client->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) /* the read side will see the client go */
+				client->out_sent = client->out_len;
+			return -errno;
+		}
+		client->out_sent += n;
+	}
+	client->out_len = client->out_sent = 0;
+	return 0;
+}
+
+/* Send what is queued, waiting for the socket if need be */
+static void flush_replies_wait(struct client *client)
+{
+	if (client->out_sent < client->out_len)
+		writepipe(client->sock, client->out + client->out_sent, client->out_len - client->out_sent);
+	client->out_len = client->out_sent = 0;
+}
+
+static void reply(struct superblock *sb, struct client *client, struct messagebuf *message)
+{
+	unsigned bytes = message->head.length + sizeof(message->head);
+
+	trace(warn("%x/%u", message->head.code, message->head.length););
+	if (!client->ring) {
+		writepipe(client->sock, &message->head, bytes);
+		return;
+	}
+	if (client->out_len + bytes > OUT_LIMIT)
+		flush_replies_wait(client);
+	if (client->out_len + bytes > client->out_size) {
+		unsigned size = client->out_size? 2 * client->out_size: 4096;
+		char *out;
+		while (size < client->out_len + bytes)
+			size *= 2;
+		if (!(out = realloc(client->out, size))) {
+			flush_replies_wait(client);
+			writepipe(client->sock, &message->head, bytes);
+			return;
+		}
+		client->out = out;
+		client->out_size = size;
+	}
+	memcpy(client->out + client->out_len, &message->head, bytes);
+	client->out_len += bytes;
+	if (list_empty(&client->replying) && !client->writable_wait)
+		list_add_tail(&client->replying, &sb->replying);
+}
+
+/*
+ * Group commit
+ *
+ * Normally each write request commits its own transaction before replying.
+ * With group commit on, write requests leave their metadata dirty and their
+ * replies are held here instead, to go out together after one commit covers
+ * every request that arrived in the same poll wakeup, or within commit_window
+ * microseconds of the first held reply.  A reply must never be sent before
+ * the metadata it depends on is in the journal.
+ */
+
+struct held_reply
+{
+	struct list_head list;
+	struct client *client;
+	struct messagebuf message;
 };
 
+static int grouping(struct superblock *sb)
+{
+	/* copyouts in flight hold replies too, until a commit drains them */
+	return (sb->runflags & RUN_GROUP_COMMIT) || sb->copyout_depth;
+}
+
+static u64 now_usecs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void commit_group(struct superblock *sb)
+{
+	commit_transaction(sb, 0);
+	while (!list_empty(&sb->held_replies)) {
+		struct held_reply *held = list_entry(sb->held_replies.next, struct held_reply, list);
+		reply(sb, held->client, &held->message);
+		list_del(&held->list);
+		free(held);
+	}
+}
+
+/*
+ * Keep the open transaction well inside both the journal and a commit block,
+ * since each further request adds its own dirty blocks before we get back to
+ * check again.
+ */
+static void check_group_commit(struct superblock *sb)
+{
+	unsigned limit = sb->image.journal_size < sb->max_commit_blocks? sb->image.journal_size: sb->max_commit_blocks;
+	if (!grouping(sb))
+		return;
+	if (dirty_buffer_count >= limit / 2 ||
+	    (!list_empty(&sb->held_replies) && now_usecs() >= sb->commit_due))
+		commit_group(sb);
+}
+
+static void commit_reply(struct superblock *sb, struct client *client, struct messagebuf *message)
+{
+	struct held_reply *held;
+
+	if (!grouping(sb) || !(held = malloc(sizeof(*held)))) {
+		if (grouping(sb))
+			commit_group(sb);
+		reply(sb, client, message);
+		return;
+	}
+	if (list_empty(&sb->held_replies))
+		sb->commit_due = now_usecs() + sb->commit_window;
+	held->client = client;
+	memcpy(&held->message, message, sizeof(struct head) + message->head.length);
+	list_add_tail(&held->list, &sb->held_replies);
+}
+
+static void drop_held_replies(struct superblock *sb, struct client *client)
+{
+	struct list_head *list, *next;
+
+	list_for_each_safe(list, next, &sb->held_replies) {
+		struct held_reply *held = list_entry(list, struct held_reply, list);
+		if (held->client == client) {
+			list_del(&held->list);
+			free(held);
+		}
+	}
+}
+
 /*
  * Cross-client Locking strategy
  *
@@ -2752,11 +5038,13 @@ struct client
  * If part of a read from a snapshot lies on the origin volume (very
  * common) then the region needs to be locked against origin writers
  * so that the data does not change while being read.  So a snapshot
- * write request loops across each chunk of the requested region and
- * either finds an existing lock on the chunk or creates a new one if
- * there are none.  Then a hold record is created and added to a list
- * on the lock record, to remember which snapshot client has locked
- * that chunk.
+ * read request collects the runs of its chunks that lie on the origin and
+ * records a hold on each run, to remember which snapshot client has
+ * locked those chunks.  A lock record is one client's hold on a range of
+ * chunks, so several clients reading the same chunk have a lock record
+ * each.  Lock records never cross a group of SNAPLOCK_GROUP chunks, and
+ * are hashed by group, so all the locks on a chunk are found in one hash
+ * chain.  A read that crosses a group boundary takes two records.
  *
  * A snapshot reader never has to wait to obtain its lock, because any
  * write requests are serialized against the read request by the server's
@@ -2772,8 +5060,9 @@ struct client
  * can be granted immediately.  Otherwise the write request has to be
  * granted later, after some read locks have been released.
  *
- * For each chunk that some client has locked for reading, a "wait"
- * record is created and entered onto a list.  (The first time a wait record
+ * For each lock record that covers chunks of the write, a "wait"
+ * record is created and entered onto a list, remembering which chunks of
+ * the lock the write is waiting for.  (The first time a wait record
  * is created for a given write request, a "pending" structure is created
  * so that all the read locks involved have something to point at.  We
  * only want one of these pending structures per write request, because
@@ -2799,12 +5088,18 @@ struct client
  * Release an origin region:
  *
  * When a snapshot client sends a release message to the server, the
- * server loops across each chunk (which must be on the origin) to find
- * a corresponding lock hold record (which must be in the hash) and
- * releases the hold.  If the hold count is now zero, then if there are any
- * write requests waiting on the read lock, their pending counts may be
- * reduced.  Any pending counts that hit zero cause a pending write
- * request to be granted.
+ * server walks each range (which must be on the origin) to find the lock
+ * records of that client covering it (which must be in the hash) and cuts
+ * the range out of them, which may split a record in two.  Write
+ * requests waiting on the chunks released have their pending counts
+ * reduced, unless they are still waiting on chunks that remain locked.
+ * Any pending counts that hit zero cause a pending write request to be
+ * granted.
+ *
+ * Lock and wait records come from pools, so that a backup streaming
+ * through a snapshot costs no allocation once the pools have grown to
+ * fit the reads it has in flight, and the hash doubles to keep its chains
+ * short as the locks held grow.  Neither shrinks until the server exits.
  */
 
 struct pending
@@ -2818,66 +5113,99 @@ struct snaplock_wait
 {
 	struct pending *pending;
 	struct snaplock_wait *next;
-};
-
-struct snaplock_hold
-{
-	struct client *client;
-	struct snaplock_hold *next;
+	chunk_t chunk; // chunks of the lock waited for
+	unsigned count;
 };
 
 struct snaplock
 {
 	struct snaplock_wait *waitlist;
-	struct snaplock_hold *holdlist;
+	struct client *client;
 	struct snaplock *next;
 	chunk_t chunk;
+	unsigned count;
 };
 
-/* !!! use structure assignment instead of calloc */
-static struct snaplock *new_snaplock(struct superblock *sb)
+#define SNAPLOCK_GROUP_BITS 6
+#define SNAPLOCK_GROUP (1 << SNAPLOCK_GROUP_BITS)
+#define SLAB_RECORDS 256
+
+static void *pool_alloc(struct pool *pool)
 {
-	return calloc(1, sizeof(struct snaplock));
+	void *record;
+
+	if (!pool->free) {
+		char *slab = malloc(SLAB_RECORDS * pool->size);
+		if (!slab)
+			error("no memory for snapshot read locks");
+		for (int i = SLAB_RECORDS; i--;) {
+			record = slab + i * pool->size;
+			*(void **)record = pool->free;
+			pool->free = record;
+		}
+	}
+	record = pool->free;
+	pool->free = *(void **)record;
+	return record;
 }
 
-static struct snaplock_wait *new_snaplock_wait(struct superblock *sb)
+static void pool_free(struct pool *pool, void *record)
 {
-	return calloc(1, sizeof(struct snaplock_wait));
+	*(void **)record = pool->free;
+	pool->free = record;
 }
 
-static struct snaplock_hold *new_snaplock_hold(struct superblock *sb)
+static struct snaplock *new_snaplock(struct superblock *sb)
 {
-	return calloc(1, sizeof(struct snaplock_hold));
+	sb->snaplock_count++;
+	return pool_alloc(&sb->snaplock_pool);
 }
 
-static void free_snaplock(struct superblock *sb, struct snaplock *p)
+static struct snaplock_wait *new_snaplock_wait(struct superblock *sb)
 {
-	free(p);
+	return pool_alloc(&sb->snaplock_wait_pool);
 }
 
-static void free_snaplock_hold(struct superblock *sb, struct snaplock_hold *p)
+static void free_snaplock(struct superblock *sb, struct snaplock *p)
 {
-	free(p);
+	sb->snaplock_count--;
+	pool_free(&sb->snaplock_pool, p);
 }
 
 static void free_snaplock_wait(struct superblock *sb, struct snaplock_wait *p)
 {
-	free(p);
+	pool_free(&sb->snaplock_wait_pool, p);
 }
 
 static unsigned snaplock_hash(struct superblock *sb, chunk_t chunk)
 {
-	unsigned bin = ((u32)(chunk * 3498734713U)) >> (32 - sb->snaplock_hash_bits); // !!! wordsize braindamage !!!
-	assert(bin >= 0 && bin < (1 << sb->snaplock_hash_bits));
-	return bin;
+	return ((chunk >> SNAPLOCK_GROUP_BITS) * 0x9e37fffffffc0001ULL) >> (64 - sb->snaplock_hash_bits);
 }
 
-static struct snaplock *find_snaplock(struct snaplock *list, chunk_t chunk)
+/* Double the hash when there are more locks than chains */
+static void grow_snaplocks(struct superblock *sb)
 {
-	for (; list; list = list->next)
-		if (list->chunk == chunk)
-			return list;
-	return NULL;
+	unsigned bits = sb->snaplock_hash_bits, i;
+	struct snaplock **old = sb->snaplocks, **table;
+
+	if (!(table = calloc(1 << (bits + 1), sizeof(struct snaplock *))))
+		return; /* longer chains will do */
+	sb->snaplocks = table;
+	sb->snaplock_hash_bits = bits + 1;
+	for (i = 0; i < 1 << bits; i++)
+		while (old[i]) {
+			struct snaplock *lock = old[i], **bucket = &table[snaplock_hash(sb, lock->chunk)];
+			old[i] = lock->next;
+			lock->next = *bucket;
+			*bucket = lock;
+		}
+	free(old);
+	trace(warn("%u locks, %u hash chains", sb->snaplock_count, 1 << sb->snaplock_hash_bits););
+}
+
+static int in_snaplock(struct snaplock *lock, chunk_t chunk, unsigned count)
+{
+	return chunk < lock->chunk + lock->count && lock->chunk < chunk + count;
 }
 
 # ifdef DEBUG_LOCKS
@@ -2891,13 +5219,10 @@ static void show_locks(struct superblock *sb)
 		if (!n) printf("Locks:\n");
 		printf("[%03u] ", i);
 		do {
-			printf("chunk %Lx ", lock->chunk);
-			struct snaplock_hold *hold = lock->holdlist;
-			for (; hold; hold = hold->next)
-				printf("held by client %Lx ", hold->client->id);
+			printf("chunks %Lx/%u held by client %Lx ", lock->chunk, lock->count, lock->client->id);
 			struct snaplock_wait *wait = lock->waitlist;
 			for (; wait; wait = wait->next)
-				printf("wait [%02hx/%u] ", snaplock_hash(sb, (u32)wait->pending), wait->pending->holdcount);
+				printf("wait [%Lx/%u %u] ", wait->chunk, wait->count, wait->pending->holdcount);
 		} while ((lock = lock->next));
 		printf("\n");
 		n++;
@@ -2907,29 +5232,36 @@ static void show_locks(struct superblock *sb)
 # endif
 
 /*
- * If the passed chunk is locked, append a new node to the lock's wait list,
- * allocating a new "pending" structure if necessary.  There is one "pending"
- * structure per client I/O, to which all affected waitlist nodes point.
- * The holdcount indicates the number of lock waitlist nodes that point to
- * it, since more than one waitlist node can point to the same "pending"
- * structure if the chunk has been locked by more than one client or more
- * than once by a client.
+ * If the passed chunk is locked, append a new node to the wait list of each
+ * lock on it, allocating a new "pending" structure if necessary.  There is
+ * one "pending" structure per client I/O, to which all affected waitlist
+ * nodes point.  The holdcount indicates the number of lock waitlist nodes
+ * that point to it, since more than one waitlist node can point to the
+ * same "pending" structure if the chunk has been locked by more than one
+ * client or more than once by a client.  Successive chunks of one write
+ * under the same lock share a wait record.
  */
 static void waitfor_chunk(struct superblock *sb, chunk_t chunk, struct pending **pending)
 {
 	struct snaplock *lock;
 
 	trace(printf("enter waitfor_chunk\n"););
-	if ((lock = find_snaplock(sb->snaplocks[snaplock_hash(sb, chunk)], chunk))) {
+	for (lock = sb->snaplocks[snaplock_hash(sb, chunk)]; lock; lock = lock->next) {
+		if (!in_snaplock(lock, chunk, 1))
+			continue;
 		if (!*pending) {
 			// arguably we should know the client and fill it in here
 			*pending = calloc(1, sizeof(struct pending));
 			(*pending)->holdcount = 1;
 		}
+		struct snaplock_wait *wait = lock->waitlist;
+		if (wait && wait->pending == *pending && wait->chunk + wait->count == chunk) {
+			wait->count++;
+			continue;
+		}
 		trace(printf("new_snaplock_wait call\n"););
-		struct snaplock_wait *wait = new_snaplock_wait(sb);
-		wait->pending = *pending;
-		wait->next = lock->waitlist;
+		wait = new_snaplock_wait(sb);
+		*wait = (struct snaplock_wait){ .pending = *pending, .chunk = chunk, .count = 1, .next = lock->waitlist };
 		lock->waitlist = wait;
 		(*pending)->holdcount++;
 	}
@@ -2940,98 +5272,132 @@ static void waitfor_chunk(struct superblock *sb, chunk_t chunk, struct pending *
 }
 
 /*
- * Lock a chunk.  If the lock structure doesn't exist for the chunk, create
- * it.  In any event, create a new hold structure and add it to the lock
- * hold list.
+ * Lock a range of chunks for a client, one lock record per group the
+ * range touches, extending a record the client already has that the
+ * range carries on from.
  */
-static void readlock_chunk(struct superblock *sb, chunk_t chunk, struct client *client)
+static void readlock_range(struct superblock *sb, chunk_t chunk, unsigned count, struct client *client)
+{
+	trace(printf("enter readlock_range\n"););
+	while (count) {
+		unsigned n = SNAPLOCK_GROUP - (chunk & (SNAPLOCK_GROUP - 1));
+		struct snaplock **bucket, *lock;
+
+		if (n > count)
+			n = count;
+		if (sb->snaplock_count >= 1U << sb->snaplock_hash_bits)
+			grow_snaplocks(sb);
+		bucket = &sb->snaplocks[snaplock_hash(sb, chunk)];
+		for (lock = *bucket; lock; lock = lock->next)
+			if (lock->client == client && lock->chunk + lock->count == chunk &&
+			    (lock->chunk >> SNAPLOCK_GROUP_BITS) == (chunk >> SNAPLOCK_GROUP_BITS))
+				break;
+		if (lock)
+			lock->count += n;
+		else {
+			trace(printf("creating a new lock\n"););
+			lock = new_snaplock(sb);
+			*lock = (struct snaplock){ .chunk = chunk, .count = n, .client = client, .next = *bucket };
+			*bucket = lock;
+		}
+		chunk += n;
+		count -= n;
+	}
+	trace(printf("leaving readlock_range\n"););
+}
+
+static void release_wait(struct superblock *sb, struct snaplock_wait *wait)
 {
-	struct snaplock **bucket = &sb->snaplocks[snaplock_hash(sb, chunk)];
-	struct snaplock *lock;
+	struct pending *pending = wait->pending;
 
-	trace(printf("enter readlock_chunk\n"););
-	if (!(lock = find_snaplock(*bucket, chunk))) {
-		trace(printf("creating a new lock\n"););
-		lock = new_snaplock(sb);
-		*lock = (struct snaplock){ .chunk = chunk, .next = *bucket };
-		*bucket = lock;
+	assert(pending->holdcount);
+	if (!--pending->holdcount) {
+		commit_reply(sb, pending->client, &pending->message);
+		free(pending);
 	}
-	trace(printf("holding snaplock\n"););
-	struct snaplock_hold *hold = new_snaplock_hold(sb);
-	trace(printf("got the snaplock?\n"););
-	hold->client = client;
-	hold->next = lock->holdlist;
-	lock->holdlist = hold;
-	trace(printf("leaving readlock_chunk\n"););
+	free_snaplock_wait(sb, wait);
 }
 
-static struct snaplock *release_lock(struct superblock *sb, struct snaplock *lock, struct client *client)
+/*
+ * Cut chunks from..to out of the lock record at *lockp, splitting it if
+ * they are in the middle and deleting it if nothing is left.  Writes that
+ * were waiting only for the chunks cut out are released.
+ */
+static void cut_snaplock(struct superblock *sb, struct snaplock **lockp, chunk_t from, chunk_t to)
 {
-	struct snaplock *ret = lock;
-	struct snaplock_hold **holdp = &lock->holdlist;
-
-	trace(printf("entered release_lock\n"););
-	while (*holdp && (*holdp)->client != client)
-		holdp = &(*holdp)->next;
+	struct snaplock *lock = *lockp, *tail = NULL;
+	struct snaplock_wait *list = lock->waitlist, *wait;
+	chunk_t end = lock->chunk + lock->count;
 
-	if (!*holdp) {
-		trace_on(printf("chunk %Lx holder %Lx not found\n", (llu_t) lock->chunk, client->id););
-		return NULL;
+	trace(printf("release %Lx-%Lx of %Lx/%u\n", from, to, lock->chunk, lock->count););
+	if (from > lock->chunk && to < end) {
+		tail = new_snaplock(sb);
+		*tail = (struct snaplock){ .chunk = to, .count = end - to, .client = lock->client, .next = lock->next };
+		lock->next = tail;
 	}
+	if (from > lock->chunk)
+		lock->count = from - lock->chunk;
+	else {
+		lock->count = end - to;
+		lock->chunk = to;
+	}
+	if (!lock->count)
+		*lockp = lock->next;
 
-	/* Delete and free holder record */
-	struct snaplock_hold *next = (*holdp)->next;
-	free_snaplock_hold(sb, *holdp);
-	*holdp = next;
-
-	if (lock->holdlist)
-		return ret;
+	lock->waitlist = NULL;
+	while ((wait = list)) {
+		int head = lock->count && in_snaplock(lock, wait->chunk, wait->count);
+		int rest = tail && in_snaplock(tail, wait->chunk, wait->count);
 
-	/* Release and delete waiters, delete lock */
-	struct snaplock_wait *list = lock->waitlist;
-	while (list) {
-		struct snaplock_wait *next = list->next;
-		assert(list->pending->holdcount);
-		if (list->pending != NULL && !--(list->pending->holdcount)) {
-			struct pending *pending = list->pending;
-			reply(pending->client->sock, &pending->message);
-			free(pending);
+		list = wait->next;
+		if (!head && !rest) {
+			release_wait(sb, wait);
+			continue;
+		}
+		if (head) {
+			wait->next = lock->waitlist;
+			lock->waitlist = wait;
+		}
+		if (rest) {
+			if (head) {
+				struct snaplock_wait *copy = new_snaplock_wait(sb);
+				*copy = *wait;
+				wait->pending->holdcount++;
+				wait = copy;
+			}
+			wait->next = tail->waitlist;
+			tail->waitlist = wait;
 		}
-		free_snaplock_wait(sb, list);
-		list = next;
 	}
-	ret = lock->next;
-	free_snaplock(sb, lock);
-
-	trace(printf("leaving release_lock\n"););
-	return ret;
+	if (!lock->count)
+		free_snaplock(sb, lock);
 }
 
-static int release_chunk(struct superblock *sb, chunk_t chunk, struct client *client)
+static void release_range(struct superblock *sb, chunk_t chunk, unsigned count, struct client *client)
 {
-	trace(printf("enter release_chunk\n"););
-	trace(printf("release %Lx\n", chunk););
-	struct snaplock **lockp = &sb->snaplocks[snaplock_hash(sb, chunk)];
+	chunk_t end = chunk + count;
 
-	/* Find pointer to lock record */
-	while (*lockp && (*lockp)->chunk != chunk) {
-		assert(lockp != &(*lockp)->next);
-		lockp = &(*lockp)->next;
-	}
-	struct snaplock *next, *lock = *lockp;
+	trace(printf("enter release_range\n"););
+	while (chunk < end) {
+		struct snaplock **lockp = &sb->snaplocks[snaplock_hash(sb, chunk)];
 
-	if (!lock) {
-		trace_on(printf("chunk %Lx not locked\n", (llu_t) chunk););
-		return -1;
+		/* Find the hold of this client on this chunk */
+		while (*lockp && ((*lockp)->client != client || !in_snaplock(*lockp, chunk, 1)))
+			lockp = &(*lockp)->next;
+		if (!*lockp) {
+			trace_on(printf("chunk %Lx not locked\n", (llu_t) chunk););
+			chunk++;
+			continue;
+		}
+		chunk_t to = (*lockp)->chunk + (*lockp)->count;
+		if (to > end)
+			to = end;
+		cut_snaplock(sb, lockp, chunk, to);
+		chunk = to;
 	}
-
-	next = release_lock(sb, lock, client);
-	*lockp = next;
-	if (!next)
-		return -2;
-
-	trace(printf("release_chunk returning 0\n next lock %p\n",next););
-	return 0;
+#ifdef DEBUG_LOCKS
+	show_locks(sb);
+#endif
 }
 
 /* Build up a response as a list of chunk ranges */
@@ -3092,11 +5458,11 @@ static int finish_reply_(struct addto *r, unsigned code, unsigned id)
 	return 1;
 }
 
-static void finish_reply(int sock, struct addto *r, unsigned code, unsigned id)
+static void finish_reply(struct superblock *sb, struct client *client, struct addto *r, unsigned code, unsigned id)
 {
 	if (finish_reply_(r, code, id)) {
 		trace(printf("sending reply... "););
-		reply(sock, (struct messagebuf *)r->reply);
+		reply(sb, client, (struct messagebuf *)r->reply);
 		trace(printf("done sending reply\n"););
 	}
 	free(r->reply); // FIXME TODO - malloc/free in the snapshot read path, bad for performance
@@ -3130,6 +5496,8 @@ static void setup_sb(struct superblock *sb)
 	unsigned snaplock_hash_bits = 8;
 	sb->snaplock_hash_bits = snaplock_hash_bits;
 	sb->snaplocks = (struct snaplock **)calloc(1 << snaplock_hash_bits, sizeof(struct snaplock *));
+	sb->snaplock_pool.size = sizeof(struct snaplock);
+	sb->snaplock_wait_pool.size = sizeof(struct snaplock_wait);
 
 	sb->metadata.asi = &sb->image.metadata; // !!! so why even have sb->metadata??
 	sb->snapdata.asi = combined(sb) ? &(sb)->image.metadata : &(sb)->image.snapdata;
@@ -3394,18 +5762,15 @@ static int client_locks(struct superblock *sb, struct client *client, int check)
 		struct snaplock **lockp = &sb->snaplocks[i];
 
 		while (*lockp) {
-			struct snaplock_hold *hold;
-
-			for (hold = (*lockp)->holdlist; hold; hold = hold->next)
-				if (hold->client == client) {
-					if (check)
-						return 1;
-					*lockp = release_lock(sb, *lockp, client);
-					goto next;
-				}
-			lockp = &(*lockp)->next;
-next:
-			continue;
+			struct snaplock *lock = *lockp;
+
+			if (lock->client != client) {
+				lockp = &lock->next;
+				continue;
+			}
+			if (check)
+				return 1;
+			cut_snaplock(sb, lockp, lock->chunk, lock->chunk + lock->count);
 		}
 	}
 	return 0;
@@ -3414,41 +5779,61 @@ next:
 #define check_client_locks(x, y) client_locks(x, y, 1)
 #define free_client_locks(x, y) client_locks(x, y, 0)
 
-/* A very simple-minded implementation.  You can do it in very
- * few operations with whole-register bit twiddling but I assume
- * that we can juse find a macro somewhere which works.
- *  AKA hamming weight, sideways add
- */
-static unsigned int bit_count(u64 num)
-{
-	unsigned count = 0;
-
-	for (; num; num >>= 1)
-		if (num & 1)
-			count++;
-
-	return count;
-}
-
 /*
  * Walk a B-tree leaf, counting shared chunks per snapshot.
  */
 static void calc_sharing(struct superblock *sb, struct eleaf *leaf, void *data)
 {
-	uint64_t *share_table = data;
 	struct exception const *p;
-	unsigned bit;
-	unsigned int share_count;
 	int i;
 
 	for (i = 0; i < leaf->count; i++)
 		for (p = emap(leaf, i); p < emap(leaf, i+1); p++) {
 			assert(p->share); // belongs in check leaf function
-			share_count = bit_count(p->share) - 1;
+			account_sharing(data, p->share, run_chunks(leaf, i));
+		}
+}
+
+/*
+ * The sharing table is saved next to the journal at shutdown, and
+ * SB_SHARING says the saved copy is current.  The flag is cleared when
+ * the server starts, so after a crash the table is counted again.
+ */
+static void save_sharing(struct superblock *sb)
+{
+	if (!(sb->image.flags & SB_SHARING_BASE))
+		return;
+	if (diskwrite(sb->metadev, sb->sharing, sizeof(sb->sharing), sb->image.sharing_base << SECTOR_BITS) < 0) {
+		warn("Unable to save sharing table: %s", strerror(errno));
+		return;
+	}
+	sb->image.flags |= SB_SHARING;
+	set_sb_dirty(sb);
+}
+
+static void setup_sharing(struct superblock *sb, int saved)
+{
+	if (saved) {
+		if (diskread(sb->metadev, sb->sharing, sizeof(sb->sharing), sb->image.sharing_base << SECTOR_BITS) >= 0)
+			return;
+		warn("Unable to load sharing table: %s", strerror(errno));
+	}
+	warn("Counting shared chunks");
+	memset(sb->sharing, 0, sizeof(sb->sharing));
+	traverse_tree_range(sb, 0, -1, calc_sharing, sb->sharing);
+}
+
+static void check_sharing(struct superblock *sb)
+{
+	static u64 counted[MAX_SNAPSHOTS * MAX_SNAPSHOTS];
 
-			for (bit = 0; bit < MAX_SNAPSHOTS; bit++)
-				if (p->share & (1ULL << (u64)bit))
-					share_table[MAX_SNAPSHOTS * bit + share_count]++;
+	memset(counted, 0, sizeof(counted));
+	traverse_tree_range(sb, 0, -1, calc_sharing, counted);
+	for (unsigned i = 0; i < MAX_SNAPSHOTS * MAX_SNAPSHOTS; i++)
+		if (sb->sharing[i] != counted[i]) {
+			warn("sharing for snapshot bit %u with %u others is %Lu, counted %Lu",
+				i / MAX_SNAPSHOTS, i % MAX_SNAPSHOTS, (llu_t)sb->sharing[i], (llu_t)counted[i]);
+			sb->sharing[i] = counted[i];
 		}
 }
 
@@ -3460,13 +5845,27 @@ static struct snapshot *client_snap(struct superblock *sb, struct client *client
 	return snapshot;
 }
 
-void outerror(int sock, int err, char *text)
+/*
+ * Error replies go through the reply queue like any other, after the write
+ * replies held for a group commit, so that a pipelined client sees them in
+ * order.
+ */
+static void outerror(struct superblock *sb, struct client *client, int err, char *text)
 {
-	unsigned len = sizeof(struct generic_error) + strlen(text) + 1;
-	if (outhead(sock, GENERIC_ERROR, len) < 0 ||
-		writepipe(sock, &err, sizeof(struct generic_error)) < 0 ||
-		writepipe(sock, text, len - sizeof(struct generic_error)) < 0)
-		warn("unable to send error %u", GENERIC_ERROR);
+	struct messagebuf message;
+	struct generic_error *body = (void *)message.body;
+	unsigned len = strlen(text);
+
+	if (len > maxbody - sizeof(*body) - 1)
+		len = maxbody - sizeof(*body) - 1;
+	message.head = (struct head){ GENERIC_ERROR, sizeof(*body) + len + 1 };
+	body->err = err;
+	memcpy(body->msg, text, len);
+	body->msg[len] = 0;
+	if (!list_empty(&sb->held_replies))
+		commit_group(sb);
+	reply(sb, client, &message);
+	flush_replies_wait(client);
 }
 
 void get_status(struct superblock *sb, unsigned sock)
@@ -3477,10 +5876,8 @@ void get_status(struct superblock *sb, unsigned sock)
 	size_t reply_len = snapshot_details_calc_size(snapshots, snapshots);
 	struct status_reply *reply = calloc(reply_len, 1); // !!! error check?
 
-	uint64_t share_array[MAX_SNAPSHOTS * MAX_SNAPSHOTS];
-	memset(share_array, 0, sizeof(share_array));
-
-	traverse_tree_range(sb, 0, -1, calc_sharing, share_array);
+	if ((sb->runflags & RUN_SELFCHECK))
+		check_sharing(sb);
 	reply->ctime = sb->image.create_time;
 	reply->meta.chunksize_bits = sb->image.metadata.allocsize_bits;
 	reply->meta.total = sb->image.metadata.chunks;
@@ -3504,7 +5901,7 @@ void get_status(struct superblock *sb, unsigned sock)
 			continue;
 		}
 		for (int col = 0; col < snapshots; ++col)
-			details->sharing[col] = share_array[MAX_SNAPSHOTS * snaplist[row].bit + col];
+			details->sharing[col] = sb->sharing[MAX_SNAPSHOTS * snaplist[row].bit + col];
 	}
 
 	if (outhead(sock, STATUS_OK, reply_len) < 0 || writepipe(sock, reply, reply_len) < 0)
@@ -3514,6 +5911,117 @@ void get_status(struct superblock *sb, unsigned sock)
 	selfcheck_freespace(sb);
 }
 
+/*
+ * Bring the superblock, allocation state and sharing summary up from disk,
+ * replaying the journal if the snapstore was not shut down cleanly, and
+ * mark it busy.
+ */
+static void load_snapstore(struct superblock *sb)
+{
+	if (diskread(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0)
+		error("Unable to read superblock: %s", strerror(errno));
+	assert(valid_sb(sb));
+	if (sb->image.metadata.allocsize_bits > MAX_BLOCK_BITS)
+		error("Metadata blocks of %u bytes are too big for a leaf map, this store can't be used",
+			1 << sb->image.metadata.allocsize_bits);
+	setup_sb(sb);
+	sb->snapmask = calc_snapmask(sb);
+	trace(printf("Active snapshot mask: %016llx\n", sb->snapmask););
+	if (sb_get_device_sizes(sb))
+		error("FIXME!!! don't exit from load_sb, return -1 instead");
+#if 0
+	// make this a startup option !!!
+	sb->metadata.chunks_used = sb->metadata.asi->chunks - count_free(sb, &sb->metadata);
+	if (combined(sb))
+		return;
+	sb->snapdata.chunks_used = sb->snapdata.asi->chunks - count_free(sb, &sb->snapdata);
+#endif
+	/* Older deferred commits may still be in the journal, fence them off */
+	sb->journal_since_barrier = sb->image.journal_size;
+	int sharing = (sb->image.flags & (SB_BUSY | SB_SHARING)) == SB_SHARING;
+	sb->image.flags &= ~SB_SHARING;
+	if (sb->image.flags & SB_BUSY) {
+		warn("Server was not shut down properly");
+		//jtrace(show_journal(sb););
+		replay_journal(sb); // !!! handle error
+	} else {
+		sb->image.flags |= SB_BUSY;
+		set_sb_dirty(sb);
+		save_sb(sb);
+	}
+	setup_summary(sb);
+	setup_sharing(sb, sharing);
+	if (setup_node_cache(sb))
+		warn("unable to allocate node cache, index nodes will not be pinned");
+}
+
+/*
+ * Snapshot reads
+ *
+ * Look up the chunks of a snapshot read, putting those only in the snapshot
+ * in the snap reply and those shared with the origin, locked against origin
+ * writes, in the org reply.  Returns the code for the snap reply.
+ */
+static unsigned snapshot_read(struct superblock *sb, struct client *client, struct rw_request *body, struct addto *org, struct addto *snap)
+{
+	struct snapshot *snapshot = client_snap(sb, client);
+	struct etree_cursor cursor;
+	chunk_t run = 0; // origin chunks to lock, as one range
+	unsigned i, j, held = 0;
+
+	if (is_squashed(snapshot)) {
+		warn("trying to read squashed snapshot %u", client->snaptag);
+		for (i = 0; i < body->count; i++)
+			for (j = 0; j < body->ranges[i].chunks; j++) {
+				chunk_t chunk = body->ranges[i].chunk + j;
+				addto_response(snap, chunk);
+				check_response_full(snap, sizeof(chunk_t));
+				*(snap->top)++ = 0;
+			}
+		return SNAPSHOT_READ_ERROR;
+	}
+
+	init_cursor(&cursor, sb);
+	for (i = 0; i < body->count; i++)
+		for (j = 0; j < body->ranges[i].chunks; j++) {
+			chunk_t chunk = body->ranges[i].chunk + j, exception = 0;
+			trace(warn("read %Lx", chunk););
+			test_unique(sb, &cursor, chunk, snapshot->bit, &exception);
+			/*
+			 * If this chunk is only in a snapshot, we
+			 * want to read only from the snapshot; if it's
+			 * shared with the origin, we want to read
+			 * that instead.  Add the chunk to the
+			 * appropriate message.
+			 */
+			if (exception) { /* It's only in a snapshot.  */
+				trace(warn("read exception %Lx", exception););
+				wait_copyouts(sb, exception, 1);
+				addto_response(snap, chunk);
+				check_response_full(snap, sizeof(chunk_t));
+				*(snap->top)++ = exception;
+			} else {	 /* Shared with the origin.   */
+				trace(warn("read origin %Lx", chunk););
+				addto_response(org, chunk);
+				/*
+				 * Lock the chunk so that later origin
+				 * writes can't change it out from
+				 * under us, a run of them at a time.
+				 */
+				if (held && chunk != run + held) {
+					readlock_range(sb, run, held, client);
+					held = 0;
+				}
+				if (!held++)
+					run = chunk;
+			}
+		}
+	if (held)
+		readlock_range(sb, run, held, client);
+	release_cursor(&cursor);
+	return SNAPSHOT_READ_OK;
+}
+
 /*
  * Responses to IO requests take two quite different paths through the
  * machinery:
@@ -3549,13 +6057,19 @@ static int incoming(struct superblock *sb, struct client *client)
 	char *why = "";
 	int i, j, err;
 
-	if ((err = readpipe(sock, &message.head, sizeof(message.head))))
+	if ((err = client_read(client, &message.head, sizeof(message.head))))
 		goto pipe_error;
 	trace(warn("%x/%u", message.head.code, message.head.length););
 	if (message.head.length > maxbody)
 		goto message_too_long;
-	if ((err = readpipe(sock, &message.body, message.head.length)))
+	if ((err = client_read(client, &message.body, message.head.length)))
 		goto pipe_error;
+	switch (message.head.code) {
+	case QUERY_WRITE: case QUERY_SNAPSHOT_READ: case FINISH_SNAPSHOT_READ:
+		break; /* replies are queued */
+	default:
+		flush_replies_wait(client);
+	}
 
 	switch (message.head.code) {
 	case QUERY_WRITE:
@@ -3564,15 +6078,18 @@ static int incoming(struct superblock *sb, struct client *client)
 			struct pending *pending = NULL;
 			struct rw_request *body = (struct rw_request *)message.body;
 			struct chunk_range *p = body->ranges;
+			struct etree_cursor cursor;
 			chunk_t chunk;
 			if (message.head.length < sizeof(*body))
 				goto message_too_short;
 
 			trace(warn("origin write query, %u ranges", body->count););
+			check_group_commit(sb);
 			message.head.code = ORIGIN_WRITE_OK;
+			init_cursor(&cursor, sb);
 			for (i = 0; i < body->count; i++, p++)
 				for (j = 0, chunk = p->chunk; j < p->chunks; j++, chunk++) {
-					chunk_t exception = make_unique(sb, chunk, -1);
+					chunk_t exception = make_unique(sb, &cursor, chunk, -1, p->chunks - j);
 					if (exception == -1) {
 						warn("ERROR: unable to perform copyout during origin write.");
 						message.head.code = ORIGIN_WRITE_ERROR;
@@ -3586,8 +6103,13 @@ static int incoming(struct superblock *sb, struct client *client)
 						waitfor_chunk(sb, chunk, &pending);
 					}
 				}
+			if (cursor.batched && flush_exceptions(&cursor))
+				message.head.code = ORIGIN_WRITE_ERROR;
+			release_cursor(&cursor);
+			release_snapblocks(sb);
 			finish_copyout(sb);
-			commit_transaction(sb, 0);
+			if (!grouping(sb))
+				commit_transaction(sb, 0);
 			/*
 			 * If waitfor_chunk() detected a pending readlock and
 			 * queued this write for it, just update the "pending"
@@ -3600,7 +6122,7 @@ static int incoming(struct superblock *sb, struct client *client)
 				pending->holdcount--;
 				break;
 			}
-			reply(sock, &message);
+			commit_reply(sb, client, &message);
 			break;
 		}
 		/* Write to snapshot */
@@ -3608,9 +6130,12 @@ static int incoming(struct superblock *sb, struct client *client)
 		if (message.head.length < sizeof(*body))
 			goto message_too_short;
 		trace(printf("snapshot write request, %u ranges\n", body->count););
+		check_group_commit(sb);
 		struct addto snap = { .nextchunk = -1 };
 		u32 ret_msgcode = SNAPSHOT_WRITE_OK;
 		struct snapshot *snapshot = client_snap(sb, client);
+		struct etree_cursor cursor;
+		init_cursor(&cursor, sb);
 		for (i = 0; i < body->count; i++)
 			for (j = 0; j < body->ranges[i].chunks; j++) {
 				chunk_t chunk = body->ranges[i].chunk + j;
@@ -3620,7 +6145,7 @@ static int incoming(struct superblock *sb, struct client *client)
 					warn("trying to write squashed snapshot, id = %u", body->id);
 					exception =  -1;
 				} else
-					exception = make_unique(sb, chunk, snapshot->bit);
+					exception = make_unique(sb, &cursor, chunk, snapshot->bit, body->ranges[i].chunks - j);
 				if (exception == -1) {
 					warn("ERROR: unable to perform copyout during snapshot write.");
 					ret_msgcode = SNAPSHOT_WRITE_ERROR;
@@ -3630,9 +6155,16 @@ static int incoming(struct superblock *sb, struct client *client)
 				check_response_full(&snap, sizeof(chunk_t));
 				*(snap.top)++ = exception;
 			}
+		if (cursor.batched && flush_exceptions(&cursor))
+			ret_msgcode = SNAPSHOT_WRITE_ERROR;
+		release_cursor(&cursor);
+		release_snapblocks(sb);
 		finish_copyout(sb);
-		commit_transaction(sb, 0);
-		finish_reply(client->sock, &snap, ret_msgcode, body->id);
+		if (!grouping(sb))
+			commit_transaction(sb, 0);
+		if (finish_reply_(&snap, ret_msgcode, body->id))
+			commit_reply(sb, client, (struct messagebuf *)snap.reply);
+		free(snap.reply);
 		break;
 	case QUERY_SNAPSHOT_READ:
 	{
@@ -3641,50 +6173,7 @@ static int incoming(struct superblock *sb, struct client *client)
 			goto message_too_short;
 		trace(printf("snapshot read request, %u ranges\n", body->count););
 		struct addto snap = { .nextchunk = -1 }, org = { .nextchunk = -1 };
-		struct snapshot *snapshot = client_snap(sb, client);
-
-		if (is_squashed(snapshot)) {
-			warn("trying to read squashed snapshot %u", client->snaptag);
-			for (i = 0; i < body->count; i++)
-				for (j = 0; j < body->ranges[i].chunks; j++) {
-					chunk_t chunk = body->ranges[i].chunk + j;
-					addto_response(&snap, chunk);
-					check_response_full(&snap, sizeof(chunk_t));
-					*(snap.top)++ = 0;
-				}
-			finish_reply(client->sock, &snap, SNAPSHOT_READ_ERROR, body->id);
-			break;
-		}
-
-		for (i = 0; i < body->count; i++)
-			for (j = 0; j < body->ranges[i].chunks; j++) {
-				chunk_t chunk = body->ranges[i].chunk + j, exception = 0;
-				trace(warn("read %Lx", chunk););
-				test_unique(sb, chunk, snapshot->bit, &exception);
-				/*
-				 * If this chunk is only in a snapshot, we
-				 * want to read only from the snapshot; if it's
-				 * shared with the origin, we want to read
-				 * that instead.  Add the chunk to the
-				 * appropriate message.
-				 */
-				if (exception) { /* It's only in a snapshot.  */
-					trace(warn("read exception %Lx", exception););
-					addto_response(&snap, chunk);
-					check_response_full(&snap, sizeof(chunk_t));
-					*(snap.top)++ = exception;
-				} else {	 /* Shared with the origin.   */
-					trace(warn("read origin %Lx", chunk););
-					addto_response(&org, chunk);
-					trace(printf("locking chunk %Lx\n", chunk););
-					/*
-					 * Lock the chunk so that later origin
-					 * writes can't change it out from
-					 * under us.
-					 */
-					readlock_chunk(sb, chunk, client);
-				}
-			}
+		unsigned code = snapshot_read(sb, client, body, &org, &snap);
 		/*
 		 * Above, we built both a SNAPSHOT_READ_ORIGIN_OK message and a
 		 * SNAPSHOT_READ_OK message.  We placed chunks that were only
@@ -3697,8 +6186,8 @@ static int incoming(struct superblock *sb, struct client *client)
 		 * The finish_reply() function conveniently frees any empty
 		 * message it receives.
 		 */
-		finish_reply(client->sock, &org, SNAPSHOT_READ_ORIGIN_OK, body->id);
-		finish_reply(client->sock, &snap, SNAPSHOT_READ_OK, body->id);
+		finish_reply(sb, client, &org, SNAPSHOT_READ_ORIGIN_OK, body->id);
+		finish_reply(sb, client, &snap, code, body->id);
 		break;
 	}
 	case FINISH_SNAPSHOT_READ:
@@ -3709,8 +6198,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		trace(printf("finish snapshot read, %u ranges\n", body->count););
 
 		for (i = 0; i < body->count; i++)
-			for (j = 0; j < body->ranges[i].chunks; j++)
-				release_chunk(sb, body->ranges[i].chunk + j, client);
+			release_range(sb, body->ranges[i].chunk, body->ranges[i].chunks, client);
 
 		break;
 	}
@@ -3793,6 +6281,9 @@ static int incoming(struct superblock *sb, struct client *client)
 
 	case CREATE_SNAPSHOT:
 	{
+		/* Held writes belong before the snapshot, not after it */
+		if (grouping(sb))
+			commit_group(sb);
 		err = create_snapshot(sb, ((struct create_snapshot *)message.body)->snap);
 		if (err < 0) {
 			why = -err == EFULL ? "too many snapshots" :
@@ -3823,6 +6314,24 @@ static int incoming(struct superblock *sb, struct client *client)
 			warn("unable to reply to delete snapshot message"); // !!! return message
 		break;
 	}
+	case DELETE_SNAPSHOTS:
+	{
+		struct delete_snapshots *body = (void *)message.body;
+		if (message.head.length < sizeof(*body))
+			goto message_too_short;
+		err = -EINVAL;
+		why = "snapshot list length mismatch";
+		if (message.head.length != sizeof(*body) + body->count * sizeof(body->snap[0]))
+			goto eek;
+		u32 tags[body->count]; // the packed list may be misaligned
+		memcpy(tags, body->snap, sizeof(tags));
+		if ((err = delete_snaps(sb, tags, body->count, &why)))
+			goto eek;
+		save_sb_check(sb);
+		if (outbead(sock, DELETE_SNAPSHOT_OK, struct { }) < 0)
+			warn("unable to reply to delete snapshots message");
+		break;
+	}
 	case INITIALIZE_SNAPSTORE: // this is a stupid feature
 	{
 		break;
@@ -3836,30 +6345,24 @@ static int incoming(struct superblock *sb, struct client *client)
 	case START_SERVER:
 	{
 		warn("Activating server");
-		if (diskread(sb->metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0)
-			error("Unable to read superblock: %s", strerror(errno));
-		assert(valid_sb(sb));
-		setup_sb(sb);
-		sb->snapmask = calc_snapmask(sb);
-		trace(printf("Active snapshot mask: %016llx\n", sb->snapmask););
-		if (sb_get_device_sizes(sb))
-			error("FIXME!!! don't exit from load_sb, return -1 instead");
-#if 0
-		// make this a startup option !!!
-		sb->metadata.chunks_used = sb->metadata.asi->chunks - count_free(sb, &sb->metadata);
-		if (combined(sb))
-			return;
-		sb->snapdata.chunks_used = sb->snapdata.asi->chunks - count_free(sb, &sb->snapdata);
-#endif
-		if (sb->image.flags & SB_BUSY) {
-			warn("Server was not shut down properly");
-			//jtrace(show_journal(sb););
-			replay_journal(sb); // !!! handle error
-		} else {
-			sb->image.flags |= SB_BUSY;
-			set_sb_dirty(sb);
-			save_sb(sb);
-		}
+		load_snapstore(sb);
+		if (sb->copyout_depth && setup_copyouts(sb))
+			error("unable to allocate copyout buffers");
+		sb->runflags |= RUN_ACTIVE;
+		break;
+	}
+	case COMPACT_TREE:
+	{
+		u64 before, after;
+		err = -EINVAL;
+		why = "server not active";
+		if (!(sb->runflags & RUN_ACTIVE))
+			goto eek;
+		why = "failed to compact tree";
+		if ((err = compact_tree(sb, &before, &after)))
+			goto eek;
+		if (outbead(sock, COMPACT_TREE_OK, struct compact_tree_ok, before, after) < 0)
+			warn("unable to reply to compact tree message");
 		break;
 	}
 	case LIST_SNAPSHOTS:
@@ -3905,7 +6408,7 @@ static int incoming(struct superblock *sb, struct client *client)
 			warn("unable to reply to set priority message");
 		break;
 	prio_error:
-		outerror(sock, -err, err_msg);
+		outerror(sb, client, -err, err_msg);
 		break;
 	}
 	case USECOUNT:
@@ -3956,7 +6459,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		break;
 
 	usecnt_error:
-		outerror(sock, -err, err_msg);
+		outerror(sb, client, -err, err_msg);
 		break;
 	}
 	case STREAM_CHANGELIST:
@@ -4023,7 +6526,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		struct status_request request;
 
 		if (message.head.length != sizeof(request)) {
-			outerror(sock, EINVAL, "state_request has wrong length");
+			outerror(sb, client, EINVAL, "state_request has wrong length");
 			break;
 		}
 		memcpy(&request, message.body, sizeof(request));
@@ -4066,7 +6569,7 @@ static int incoming(struct superblock *sb, struct client *client)
 		if (reply.count == 0) {
 			snprintf(err_msg, MAX_ERRMSG_SIZE, "Snapshot %u is not valid", snap);
 			err_msg[MAX_ERRMSG_SIZE-1] = '\0';
-			outerror(sock, EINVAL, err_msg);
+			outerror(sb, client, EINVAL, err_msg);
 		} else if (outbead(sock, SNAPSHOT_SECTORS, struct snapshot_sectors, reply.snap, reply.count) < 0)
 			warn("unable to send snapshot sectors message");
 		break;
@@ -4080,13 +6583,14 @@ static int incoming(struct superblock *sb, struct client *client)
 
 		if (sb->metadev == sb->snapdev) {
 			if (snapsize && metasize && snapsize != metasize) {
-				outerror(sock, EINVAL, "snapshot device and metadata device are the same, can't resize them to two values");
+				outerror(sb, client, EINVAL, "snapshot device and metadata device are the same, can't resize them to two values");
 				break;
 			}
 			if (!metasize)
 				metasize = snapsize;
 		}
 		err = change_device_sizes(sb, orgsize, snapsize, metasize);
+		setup_summary(sb);
 		check_freespace(sb);
 		/* return the device sizes after change_device_sizes */
 		orgsize = sb->image.orgsectors << SECTOR_BITS;
@@ -4143,7 +6647,7 @@ static int incoming(struct superblock *sb, struct client *client)
 
 eek:
 	warn("%s", why);
-	outerror(sock, -err, why);
+	outerror(sb, client, -err, why);
 	return 0;
 
 message_too_long:
@@ -4167,9 +6671,11 @@ pipe_error:
 static int cleanup(struct superblock *sb)
 {
 	commit_deferred_allocs(sb);
+	save_sharing(sb);
 	sb->image.flags &= ~SB_BUSY;
 	set_sb_dirty(sb);
 	save_sb(sb);
+	show_buffer_stats();
 	return 0;
 }
 
@@ -4216,16 +6722,98 @@ int snap_server_setup(const char *agent_sockname, const char *server_sockname, i
 	return 0;
 }
 
+/*
+ * Event loop
+ *
+ * Sockets are watched with epoll, so a wakeup costs in proportion to the
+ * sockets that have something to say, not to the number connected.  Client
+ * sockets are edge triggered: an edge puts the client on the ready list and
+ * it stays there, getting one read per pass so that a busy client can't
+ * starve the others, until its socket has nothing more to read.  The epoll
+ * data of a client is the client itself, the other sockets are tagged with
+ * small numbers that no client pointer can have.
+ */
+enum { EVENT_LISTEN = 1, EVENT_SIGNAL, EVENT_AGENT, EVENT_COPYOUT };
+
+#define MAX_EVENTS 64
+
+static void watch_fd(int epfd, int fd, u32 events, void *data)
+{
+	struct epoll_event event = { .events = events, .data.ptr = data };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+		error("unable to watch socket %i: %s", fd, strerror(errno));
+}
+
+/* Client sockets are edge triggered, and watched for room to write while replies wait */
+static void watch_client(int epfd, struct client *client, int op)
+{
+	struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = client };
+	if (client->writable_wait)
+		event.events |= EPOLLOUT;
+	if (epoll_ctl(epfd, op, client->sock, &event) == -1)
+		error("unable to watch client socket %i: %s", client->sock, strerror(errno));
+}
+
+/*
+ * Read what the client has sent and handle every complete message.  Returns
+ * one if the socket may have more, zero if it is drained, or what incoming()
+ * returned if that was negative.  At end of file the messages already in
+ * hand are still handled before the client is dropped.  A short read
+ * normally means drained, but not once the peer has hung up: the end of
+ * file may have come in with the last of the data, on the same edge.
+ */
+static int receive(struct superblock *sb, struct client *client)
+{
+	unsigned room = CLIENT_RING - ring_used(client);
+	int n = fill_ring(client), result;
+
+	while (message_ready(client))
+		if ((result = incoming(sb, client)) < 0)
+			return result;
+	if (n == 0 || (n < 0 && n != -EAGAIN))
+		return -1;
+	return n == room || (n > 0 && client->hangup);
+}
+
+static void drop_client(struct superblock *sb, int epfd, struct client *client)
+{
+	warn("Client %Lx disconnected", client->id);
+
+	if ((client->flags & SNAPCLIENT_BIT)) {
+		struct snapshot *snapshot = client_snap(sb, client);
+		if (!is_squashed(snapshot)) {
+			assert(sb->usecount[snapshot->bit] > 0);
+			sb->usecount[snapshot->bit]--;
+		}
+		free_client_locks(sb, client);
+	}
+	drop_held_replies(sb, client);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, client->sock, NULL);
+	close(client->sock);
+	list_del(&client->list);
+	if (!list_empty(&client->ready))
+		list_del(&client->ready);
+	if (!list_empty(&client->replying))
+		list_del(&client->replying);
+	free(client->ring);
+	free(client->out);
+	free(client);
+}
+
 int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd, const char *logfile)
 {
-	unsigned maxclients = 100, clients = 0, others = 3;
-	struct client *clientvec[maxclients];
-	struct pollfd pollvec[others+maxclients];
-	int err = 0;
+	struct epoll_event events[MAX_EVENTS];
+	LIST_HEAD(clients);
+	LIST_HEAD(ready);
+	int epfd, err = 0;
 
-	pollvec[0] = (struct pollfd){ .fd = listenfd, .events = POLLIN };
-	pollvec[1] = (struct pollfd){ .fd = getsigfd, .events = POLLIN };
-	pollvec[2] = (struct pollfd){ .fd = agentfd, .events = POLLIN };
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		error("unable to create epoll instance: %s", strerror(errno));
+	watch_fd(epfd, listenfd, EPOLLIN, (void *)EVENT_LISTEN);
+	watch_fd(epfd, getsigfd, EPOLLIN, (void *)EVENT_SIGNAL);
+	watch_fd(epfd, agentfd, EPOLLIN, (void *)EVENT_AGENT);
+	if (sb->copyout_event >= 0)
+		watch_fd(epfd, sb->copyout_event, EPOLLIN, (void *)EVENT_COPYOUT);
 
 	if ((err = prctl(PR_SET_LESS_THROTTLE, 0, 0, 0, 0)))
 		warn("can not set process to throttle less (error %i, %s)", errno, strerror(errno));
@@ -4233,118 +6821,183 @@ int snap_server(struct superblock *sb, int listenfd, int getsigfd, int agentfd,
 		warn("failed to enter memalloc mode (may deadlock) (error %i, %s)", errno, strerror(errno));
 
 	while (1) {
+		struct timespec wait, *timeout = NULL;
 		trace(warn("Waiting for activity"););
 
-		int activity = poll(pollvec, others+clients, -1);
+		/*
+		 * Don't sleep past the end of an open group commit window,
+		 * unless it is waiting on copyouts, which will wake us
+		 */
+		if (!list_empty(&sb->held_replies) && !sb->copyouts_busy) {
+			u64 now = now_usecs(), due = sb->commit_due;
+			u64 usecs = due > now? due - now: 0;
+			wait = (struct timespec){ .tv_sec = usecs / 1000000, .tv_nsec = usecs % 1000000 * 1000 };
+			timeout = &wait;
+		}
 
-		if (activity < 0) {
-			if (errno != EINTR)
-				error("poll failed: %s", strerror(errno));
-			continue;
+		/* Keep deleting between messages, but take every message first */
+		int deleting = (sb->runflags & RUN_ACTIVE) && sb->image.deleting;
+		if (deleting || !list_empty(&ready)) {
+			wait = (struct timespec){ };
+			timeout = &wait;
 		}
 
-		if (!activity) {
-			printf("waiting...\n");
+		/*
+		 * epoll_wait() only times out in milliseconds, too coarse for
+		 * a group commit window, so a timed wait sleeps in ppoll() on
+		 * the epoll fd and then collects the events without waiting.
+		 */
+		int count;
+		if (timeout && (timeout->tv_sec || timeout->tv_nsec)) {
+			struct pollfd pollfd = { .fd = epfd, .events = POLLIN };
+			if ((count = ppoll(&pollfd, 1, timeout, NULL)) > 0)
+				count = epoll_wait(epfd, events, MAX_EVENTS, 0);
+		} else
+			count = epoll_wait(epfd, events, MAX_EVENTS, timeout? 0: -1);
+
+		if (count < 0) {
+			if (errno != EINTR)
+				error("poll failed: %s", strerror(errno));
 			continue;
 		}
+		int activity = count;
 
-		/* New connection? */
-		if (pollvec[0].revents) {
-			struct sockaddr_in addr;
-			unsigned int addr_len = sizeof(addr);
-			int clientfd;
+		for (int i = 0; i < count; i++) {
+			u32 revents = events[i].events;
 
-			if ((clientfd = accept(listenfd, (struct sockaddr *)&addr, &addr_len))<0)
-				error("Cannot accept connection: %s", strerror(errno));
+			switch ((unsigned long)events[i].data.ptr) {
+			case EVENT_LISTEN: /* New connection? */
+			{
+				struct sockaddr_in addr;
+				unsigned int addr_len = sizeof(addr);
+				int clientfd;
 
-			trace_on(warn("Received connection"););
-			assert(clients < maxclients); // !!! send error and disconnect
+				if ((clientfd = accept(listenfd, (struct sockaddr *)&addr, &addr_len))<0)
+					error("Cannot accept connection: %s", strerror(errno));
 
-			struct client *client = malloc(sizeof(struct client));
-			*client = (struct client){ .sock = clientfd };
-			clientvec[clients] = client;
-			pollvec[others+clients] = 
-				(struct pollfd){ .fd = clientfd, .events = POLLIN };
-			clients++;
-		}
+				trace_on(warn("Received connection"););
 
-		/* Signal? */
-		if (pollvec[1].revents) {
-			assert(pollvec[1].revents & POLLIN);
-			u8 sig = 0;
-			/* it's stupid but this read also gets interrupted, so... */
-			do { } while (read(getsigfd, &sig, 1) == -1 && errno == EINTR);
-			trace_on(warn("Caught signal %i", sig););
-			switch (sig) {
-				case SIGINT:
-				case SIGTERM:
-					cleanup(sb); // !!! don't do it on segfault
-					(void)flush_buffers();
-					evict_buffers();
-					signal(sig, SIG_DFL); /* this should happen automatically */
-					raise(sig); /* commit harikiri */
-					err = DDSNAPD_CAUGHT_SIGNAL; /* FIXME we never get here */
-					goto done;
-					break;
-				case SIGHUP:
-					fflush(stderr);
-					fflush(stdout);
-					re_open_logfile(logfile);
-					break;
-				default:
-					warn("Unexpected signal %i", sig);
+				struct client *client = malloc(sizeof(struct client));
+				char *ring = malloc(CLIENT_RING);
+				if (!client || !ring) {
+					warn("no memory for new client, dropping connection");
+					free(client);
+					free(ring);
+					close(clientfd);
 					break;
+				}
+				*client = (struct client){ .sock = clientfd, .ring = ring };
+				list_add_tail(&client->list, &clients);
+				INIT_LIST_HEAD(&client->ready);
+				INIT_LIST_HEAD(&client->replying);
+				watch_client(epfd, client, EPOLL_CTL_ADD);
+				break;
+			}
+			case EVENT_SIGNAL: /* Signal? */
+			{
+				assert(revents & EPOLLIN);
+				u8 sig = 0;
+				/* it's stupid but this read also gets interrupted, so... */
+				do { } while (read(getsigfd, &sig, 1) == -1 && errno == EINTR);
+				trace_on(warn("Caught signal %i", sig););
+				switch (sig) {
+					case SIGINT:
+					case SIGTERM:
+						cleanup(sb); // !!! don't do it on segfault
+						(void)flush_buffers();
+						evict_buffers();
+						signal(sig, SIG_DFL); /* this should happen automatically */
+						raise(sig); /* commit harikiri */
+						err = DDSNAPD_CAUGHT_SIGNAL; /* FIXME we never get here */
+						goto done;
+						break;
+					case SIGHUP:
+						show_buffer_stats();
+						fflush(stderr);
+						fflush(stdout);
+						re_open_logfile(logfile);
+						break;
+					default:
+						warn("Unexpected signal %i", sig);
+						break;
+				}
+				break;
+			}
+			case EVENT_COPYOUT: /* Copyouts done? */
+				async_reap(0);
+				break;
+			case EVENT_AGENT: /* Agent message? */
+				if (revents & (EPOLLHUP|EPOLLERR)) { /* agent went away */
+					cleanup(sb);
+					err = DDSNAPD_AGENT_ERROR;
+					goto done;
+				}
+				incoming(sb, &(struct client){ .sock = agentfd, .id = -2, .snaptag = -2 });
+				break;
+			default: /* Client message, or room to send */
+			{
+				struct client *client = events[i].data.ptr;
+				trace_off(printf("event on socket %i = %x\n", client->sock, revents););
+				if ((revents & EPOLLOUT) && client->writable_wait && flush_replies(client) != -EAGAIN) {
+					client->writable_wait = 0;
+					watch_client(epfd, client, EPOLL_CTL_MOD);
+				}
+				if (revents & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+					client->hangup = 1;
+				if ((revents & ~EPOLLOUT) && list_empty(&client->ready))
+					list_add_tail(&client->ready, &ready);
+				break;
+			}
 			}
 		}
 
-		/* Agent message? */
-		if (pollvec[2].revents) {
-			if (pollvec[2].revents & (POLLHUP|POLLERR)) { /* agent went away */
+		/* One read from each ready client */
+		struct list_head *entry, *next, *last = ready.prev;
+		list_for_each_safe(entry, next, &ready) {
+			struct client *client = list_entry(entry, struct client, ready);
+			int result = receive(sb, client);
+
+			activity++;
+			if (result == -1)
+				drop_client(sb, epfd, client);
+			else if (result == -2) { // !!! wrong !!!
 				cleanup(sb);
-				err = DDSNAPD_AGENT_ERROR;
+				err = DDSNAPD_CLIENT_ERROR;
 				goto done;
+			} else if (!result) {
+				list_del(&client->ready);
+				INIT_LIST_HEAD(&client->ready);
 			}
-			incoming(sb, &(struct client){ .sock = agentfd, .id = -2, .snaptag = -2 });
+			if (entry == last)
+				break;
 		}
 
-		/* Client message? */
-		unsigned i = 0;
-		while (i < clients) {
-			if (pollvec[others+i].revents) { // !!! check for poll error
-				struct client *client = clientvec[i];
-				int result;
-
-				trace_off(printf("event on socket %i = %x\n", client->sock, pollvec[others+i].revents););
-				if ((result = incoming(sb, client)) == -1) {
-					warn("Client %Lx disconnected", client->id);
-
-					if ((client->flags & SNAPCLIENT_BIT)) {
-						struct snapshot *snapshot = client_snap(sb, client);
-						if (!is_squashed(snapshot)) {
-							assert(sb->usecount[snapshot->bit] > 0);
-							sb->usecount[snapshot->bit]--;
-						}
-						free_client_locks(sb, client);
-					}
-					close(client->sock);
-					free(client);
-					--clients;
-					clientvec[i] = clientvec[clients];
-					pollvec[others + i] = pollvec[others + clients];
-					continue;
-				}
-
-				if (result == -2) { // !!! wrong !!!
-					cleanup(sb);
-					err = DDSNAPD_CLIENT_ERROR;
-					goto done;
-				}
+		if (!list_empty(&sb->held_replies) && !sb->copyouts_busy && now_usecs() >= sb->commit_due)
+			commit_group(sb);
+
+		/* Send the replies queued this round */
+		while (!list_empty(&sb->replying)) {
+			struct client *client = list_entry(sb->replying.next, struct client, replying);
+			list_del(&client->replying);
+			INIT_LIST_HEAD(&client->replying);
+			if (flush_replies(client) == -EAGAIN) {
+				client->writable_wait = 1;
+				watch_client(epfd, client, EPOLL_CTL_MOD);
 			}
-			i++;
 		}
+		if (deleting && delete_step(sb, activity ? DELETE_LEAVES / 4 : DELETE_LEAVES))
+			warn("unable to delete snapshot bits %Lx", (llu_t)sb->image.deleting);
 	}
 done:
-	// in a perfect world we'd close all the connections
+	while (!list_empty(&clients)) {
+		struct client *client = list_entry(clients.next, struct client, list);
+		close(client->sock);
+		list_del(&client->list);
+		free(client->ring);
+		free(client->out);
+		free(client);
+	}
+	close(epfd);
 	close(listenfd);
 	return err;
 }
@@ -4355,7 +7008,9 @@ struct superblock *new_sb(int metadev, int orgdev, int snapdev)
 	struct superblock *sb;
 	if ((error = posix_memalign((void **)&sb, SECTOR_SIZE, sizeof(*sb))))
 		error("no memory for superblock: %s", strerror(error));
-	*sb = (struct superblock){ .orgdev = orgdev, .snapdev = snapdev, .metadev = metadev };
+	*sb = (struct superblock){ .orgdev = orgdev, .snapdev = snapdev, .metadev = metadev, .copyout_event = -1 };
+	INIT_LIST_HEAD(&sb->held_replies);
+	INIT_LIST_HEAD(&sb->replying);
 	return sb;
 }
 
@@ -4375,12 +7030,17 @@ int init_snapstore(int orgdev, int snapdev, int metadev, unsigned bs_bits, unsig
 {
 	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
 
+	if (bs_bits > MAX_BLOCK_BITS) {
+		warn("metadata block size %u is too big for a leaf map", 1 << bs_bits);
+		goto fail;
+	}
 	unsigned bufsize = 1 << bs_bits;
-	init_buffers(bufsize, 0); /* do not preallocate buffers */
+	init_buffers(bufsize, 0, 0); /* do not preallocate buffers */
 	if (init_super(sb, js_bytes, bs_bits, cs_bits) < 0)
 		goto fail;
 	if (init_journal(sb) < 0)
 		goto fail;
+	save_sharing(sb);
 	save_sb_check(sb);
 	free(sb->copybuf);
 	free(sb->snaplocks);
@@ -4391,10 +7051,74 @@ fail:
 	return -1;
 }
 
+int compact_snapstore(int orgdev, int snapdev, int metadev, u64 *before, u64 *after)
+{
+	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
+	int err = -1;
+
+	if (diskread(metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0) {
+		warn("Unable to read superblock: %s", strerror(errno));
+		goto out;
+	}
+	if (!valid_sb(sb)) {
+		warn("Invalid superblock");
+		goto out;
+	}
+	if (sb->image.flags & SB_BUSY) {
+		warn("Snapshot store is in use or was not shut down properly, start and stop the server first");
+		goto out;
+	}
+	init_buffers(1 << sb->image.metadata.allocsize_bits, 0, 0);
+	load_snapstore(sb);
+	err = compact_tree(sb, before, after);
+	cleanup(sb);
+	unpin_nodes(sb);
+	free_summary(sb->meta_summary);
+	if (sb->snap_summary != sb->meta_summary)
+		free_summary(sb->snap_summary);
+	free(sb->copybuf);
+	free(sb->snaplocks);
+out:
+	free(sb);
+	return err;
+}
+
+int import_snapstore(int orgdev, int snapdev, int metadev, FILE *tuples, u64 *count)
+{
+	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
+	int err = -1;
+
+	if (diskread(metadev, &sb->image, 4096, SB_SECTOR << SECTOR_BITS) < 0) {
+		warn("Unable to read superblock: %s", strerror(errno));
+		goto out;
+	}
+	if (!valid_sb(sb)) {
+		warn("Invalid superblock");
+		goto out;
+	}
+	if (sb->image.flags & SB_BUSY) {
+		warn("Snapshot store is in use or was not shut down properly, start and stop the server first");
+		goto out;
+	}
+	init_buffers(1 << sb->image.metadata.allocsize_bits, 0, 0);
+	load_snapstore(sb);
+	err = import_tree(sb, tuples, count);
+	cleanup(sb);
+	unpin_nodes(sb);
+	free_summary(sb->meta_summary);
+	if (sb->snap_summary != sb->meta_summary)
+		free_summary(sb->snap_summary);
+	free(sb->copybuf);
+	free(sb->snaplocks);
+out:
+	free(sb);
+	return err;
+}
+
 int start_server(
 	int orgdev, int snapdev, int metadev, 
 	char const *agent_sockname, char const *server_sockname, char const *logfile, char const *pidfile,
-	int nobg, uint64_t cachesize_bytes, enum runflags flags)
+	int nobg, uint64_t cachesize_bytes, enum runflags flags, unsigned commit_window, unsigned copyout_depth)
 {
 	struct superblock *sb = new_sb(metadev, orgdev, snapdev);
 
@@ -4410,6 +7134,13 @@ int start_server(
 		error("Invalid superblock: If this is your first run, use --initialize to initialize the superblock.\n"
 		      "If you are upgrading from some older version, run 'ddsnap-sb' first to upgrade the superblock.\n");
 	sb->runflags = flags;
+	sb->commit_window = commit_window;
+	if (copyout_depth) {
+		if ((sb->copyout_event = async_start(copyout_depth, 0)) < 0)
+			warn("unable to start asynchronous copyout (%s), copying synchronously", strerror(-sb->copyout_event));
+		else
+			sb->copyout_depth = copyout_depth;
+	}
 
 	unsigned bufsize = 1 << sb->image.metadata.allocsize_bits;
 	if (cachesize_bytes == 0) {
@@ -4432,7 +7163,9 @@ int start_server(
 	 * to tell init_buffers to set the initial and max cache size the same.
 	 */
 	trace_on(warn("Setting cache size to %llu bytes.\n", cachesize_bytes););
-	init_buffers(bufsize, cachesize_bytes);
+	init_buffers(bufsize, cachesize_bytes, flags & RUN_SELFCHECK);
+	const char *kernel = init_map_search();
+	trace_on(warn("Searching leaf maps with %s kernel", kernel););
 	
 	if (snap_server_setup(agent_sockname, server_sockname, &listenfd, &agentfd) < 0)
 		error("Could not setup snapshot server\n");
@@ -4454,9 +7187,15 @@ int start_server(
 	}
 
 	/* To avoid writeout deadlock, we can't let ourselves be
-	 * swapped out, so lock everything into RAM.
+	 * swapped out, so lock everything into RAM.  Lock pages as they
+	 * are faulted in where we can, so the buffer pool need not all be
+	 * faulted in before we start serving.
 	 */
-	if (mlockall(MCL_CURRENT|MCL_FUTURE))
+	int locked = -1;
+#ifdef MCL_ONFAULT
+	locked = mlockall(MCL_CURRENT|MCL_FUTURE|MCL_ONFAULT);
+#endif
+	if (locked && mlockall(MCL_CURRENT|MCL_FUTURE))
 		warn("Unable to lock self into RAM: %s", strerror(errno));
 
 	/* should only return on an error */
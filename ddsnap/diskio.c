@@ -1,7 +1,9 @@
 #define _XOPEN_SOURCE 500 /* pwrite */
+#define _DEFAULT_SOURCE /* preadv, pwritev */
 #include <unistd.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <linux/fs.h> // for BLKGETSIZE
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -99,6 +101,52 @@ int diskwrite(int fd, void const *data, size_t count, off_t offset)
 	return fdio(fd, (void *)data, count, 1, offset, 1);
 }
 
+/*
+ * Read or write an iovec array from or to consecutive bytes at the given
+ * offset, at most IOV_MAX entries per preadv() or pwritev().  Short
+ * transfers are restarted from wherever they stopped, which means the
+ * caller's iovec array gets modified.
+ */
+static int fdiov(int fd, struct iovec *iov, int count, off_t offset, int do_write)
+{
+	while (count) {
+		int n = count < IOV_MAX? count: IOV_MAX;
+		ssize_t ret = do_write? pwritev(fd, iov, n, offset): preadv(fd, iov, n, offset);
+
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (ret == 0)
+			return -EIO;
+
+		offset += ret;
+		while (count && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (ret) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
+
+int diskreadv(int fd, struct iovec *iov, int count, off_t offset)
+{
+	return fdiov(fd, iov, count, offset, 0);
+}
+
+int diskwritev(int fd, struct iovec *iov, int count, off_t offset)
+{
+	return fdiov(fd, iov, count, offset, 1);
+}
+
 int fdread(int fd, void *data, size_t count)
 {
 	return fdio(fd, data, count, 0, 0, 0);
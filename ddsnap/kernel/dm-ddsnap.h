@@ -64,6 +64,9 @@ enum csnap_codes
 	REQUEST_SNAPSHOT_SECTORS, // !!! don't dedicate a whole message type to just this, return some other global stats here (and move me out of kernel)
 	SNAPSHOT_SECTORS,
 	RESIZE, /* New in 0.6 */
+	DELETE_SNAPSHOTS,
+	COMPACT_TREE,
+	COMPACT_TREE_OK,
 };
 
 enum csnap_error_codes
@@ -94,6 +97,8 @@ struct identify_ok { uint32_t chunksize_bits; } PACKED;
 struct identify_error { uint32_t err; char msg[]; } PACKED; // !!! why not use reply_error and include msg
 struct connect_server_error { uint32_t err; char msg[]; } PACKED; // !!! why not use reply_error and include msg
 struct create_snapshot { uint32_t snap; } PACKED;
+struct delete_snapshots { uint32_t count; uint32_t snap[]; } PACKED;
+struct compact_tree_ok { uint64_t before; uint64_t after; } PACKED; // tree blocks
 struct generate_changelist { uint32_t snap1; uint32_t snap2; } PACKED;
 struct generate_origindiff { uint32_t snap; } PACKED;
 struct snapinfo { uint32_t snap; int8_t prio; uint16_t usecnt; uint64_t ctime; } PACKED;
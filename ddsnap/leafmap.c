@@ -0,0 +1,136 @@
+#include "leafmap.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define X86
+#endif
+
+/* The vector kernels count through a window of this many entries */
+#define MAP_SCAN 8
+
+static inline unsigned map_end(const struct etree_map *map, unsigned i)
+{
+	return map[i].rchunk + map[i].run;
+}
+
+unsigned map_search_binary(const struct etree_map *map, unsigned count, unsigned target)
+{
+	unsigned lo = 0, hi = count;
+
+	while (lo < hi) {
+		unsigned i = (lo + hi) / 2;
+		if (map_end(map, i) >= target)
+			hi = i;
+		else
+			lo = i + 1;
+	}
+	return lo;
+}
+
+/*
+ * The same search with the branch turned into a conditional move, so the
+ * loop runs a fixed log2(count) times and never mispredicts.
+ */
+unsigned map_search_branchless(const struct etree_map *map, unsigned count, unsigned target)
+{
+	const struct etree_map *base = map;
+
+	if (!count)
+		return 0;
+	while (count > 1) {
+		unsigned half = count / 2;
+		base = map_end(base, half) < target? base + half: base;
+		count -= half;
+	}
+	return base - map + (map_end(base, 0) < target);
+}
+
+#ifdef X86
+/*
+ * The vector kernels narrow the search branchlessly to a window of at most
+ * MAP_SCAN entries, then count the entries in it that end before the
+ * target, several at a time and again without branches.  They rely on the
+ * x86 layout of a map entry: a 32 bit word holding offset in the low 20
+ * bits and run in the high 12, then rchunk.  There is no unsigned compare,
+ * so both sides are biased by 2^31 and compared signed.
+ */
+static inline const struct etree_map *map_window(const struct etree_map *map, unsigned *count, unsigned target)
+{
+	while (*count > MAP_SCAN) {
+		unsigned half = *count / 2;
+		map = map_end(map, half) < target? map + half: map;
+		*count -= half;
+	}
+	return map;
+}
+
+__attribute__((target("sse2")))
+unsigned map_search_sse2(const struct etree_map *map, unsigned count, unsigned target)
+{
+	const struct etree_map *base = map_window(map, &count, target);
+	__m128i bias = _mm_set1_epi32(0x80000000), key = _mm_set1_epi32(target ^ 0x80000000);
+	unsigned i, less = 0;
+
+	for (i = 0; i + 2 <= count; i += 2) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(base + i));
+		__m128i end = _mm_add_epi32(_mm_srli_epi64(v, 32), _mm_srli_epi32(v, 20));
+		unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(key, _mm_xor_si128(end, bias))));
+		less += (mask & 1) + (mask >> 2 & 1);
+	}
+	if (i < count)
+		less += map_end(base, i) < target;
+	return base - map + less;
+}
+
+__attribute__((target("avx2,popcnt")))
+unsigned map_search_avx2(const struct etree_map *map, unsigned count, unsigned target)
+{
+	const struct etree_map *base = map_window(map, &count, target);
+	__m256i bias = _mm256_set1_epi32(0x80000000), key = _mm256_set1_epi32(target ^ 0x80000000);
+	unsigned i, less = 0;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(base + i));
+		__m256i end = _mm256_add_epi32(_mm256_srli_epi64(v, 32), _mm256_srli_epi32(v, 20));
+		less += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(key, _mm256_xor_si256(end, bias)))) & 0x55);
+	}
+	for (; i < count; i++)
+		less += map_end(base, i) < target;
+	return base - map + less;
+}
+#endif
+
+struct map_search_kernel map_search_kernels[] = {
+#ifdef X86
+	{ "avx2", map_search_avx2 },
+	{ "sse2", map_search_sse2 },
+#endif
+	{ "branchless", map_search_branchless },
+	{ "binary", map_search_binary },
+	{ }
+};
+
+map_search_t *map_search = map_search_binary;
+
+/* Pick the first kernel this cpu can run */
+const char *init_map_search(void)
+{
+	struct map_search_kernel *kernel, *best = NULL;
+
+#ifdef X86
+	__builtin_cpu_init();
+#endif
+	for (kernel = map_search_kernels; kernel->name; kernel++) {
+		kernel->supported = 1;
+#ifdef X86
+		if (kernel->search == map_search_avx2)
+			kernel->supported = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+		if (kernel->search == map_search_sse2)
+			kernel->supported = __builtin_cpu_supports("sse2");
+#endif
+		if (kernel->supported && !best)
+			best = kernel;
+	}
+	map_search = best->search;
+	return best->name;
+}
@@ -0,0 +1,38 @@
+#ifndef __DDSNAP_LEAFMAP_H
+#define __DDSNAP_LEAFMAP_H
+
+#include <stdint.h>
+
+/*
+ * Leaf map lookup.  A btree leaf starts with a map of runs sorted by
+ * relative chunk: entry i covers chunks rchunk up to rchunk + run.  Finding
+ * the run for a chunk is the hottest lookup in the server, so there are
+ * several kernels for it and init_map_search() picks the best one the cpu
+ * supports.  Each returns the index of the first entry whose run ends at or
+ * past the target, which is count if there is none.
+ */
+
+struct etree_map
+{
+	uint32_t offset:20, run:12; // little endian on disk
+	uint32_t rchunk;
+};
+
+typedef unsigned map_search_t(const struct etree_map *map, unsigned count, unsigned target);
+
+map_search_t map_search_binary;
+
+/* In order of preference, ending with a null name */
+struct map_search_kernel
+{
+	const char *name;
+	map_search_t *search;
+	int supported; // set by init_map_search()
+};
+
+extern struct map_search_kernel map_search_kernels[];
+extern map_search_t *map_search;
+
+const char *init_map_search(void);
+
+#endif // __DDSNAP_LEAFMAP_H
@@ -0,0 +1,83 @@
+/*
+ * Time the leaf map lookup kernels against how full the leaf is.
+ *
+ * Builds leaf maps of increasing size with runs of random length and gaps
+ * between them, checks each kernel against binary search, then prints the
+ * average nanoseconds per lookup for a stream of random targets.
+ *
+ * usage: leafbench [lookups]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "leafmap.h"
+
+#define error(string, args...) do { printf(string "\n", ##args); exit(1); } while (0)
+
+/* As many map entries as a 4K leaf holds with one exception per run */
+#define MAX_ENTRIES ((4096 - 24) / (sizeof(struct etree_map) + 16))
+#define TARGETS 4096
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned fill(struct etree_map *map, unsigned count)
+{
+	unsigned i, rchunk = 0;
+
+	for (i = 0; i < count; i++) {
+		rchunk += rand() % 4;
+		map[i] = (struct etree_map){ .offset = 4096, .run = rand() % 8, .rchunk = rchunk };
+		rchunk += map[i].run + 1;
+	}
+	map[count] = (struct etree_map){ .offset = 4096 };
+	return rchunk;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long lookups = argc > 1? strtoul(argv[1], NULL, 0): 10000000;
+	unsigned sizes[] = { 1, 4, 8, 16, 32, 64, 96, 128, MAX_ENTRIES }, targets[TARGETS];
+	struct etree_map map[MAX_ENTRIES + 1];
+	struct map_search_kernel *kernel;
+	unsigned i, j, sum = 0;
+
+	printf("default kernel: %s\n", init_map_search());
+	printf("%8s", "entries");
+	for (kernel = map_search_kernels; kernel->name; kernel++)
+		if (kernel->supported)
+			printf(" %10s", kernel->name);
+	printf("   (ns per lookup)\n");
+
+	for (i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+		unsigned count = sizes[i], range = fill(map, count) + 2;
+
+		for (j = 0; j < TARGETS; j++)
+			targets[j] = rand() % range;
+		printf("%8u", count);
+		for (kernel = map_search_kernels; kernel->name; kernel++) {
+			unsigned long n;
+			double start;
+
+			if (!kernel->supported)
+				continue;
+			for (j = 0; j < TARGETS; j++)
+				if (kernel->search(map, count, targets[j]) != map_search_binary(map, count, targets[j]))
+					error("%s kernel finds %u for target %u of %u entries, not %u", kernel->name,
+						kernel->search(map, count, targets[j]), targets[j], count,
+						map_search_binary(map, count, targets[j]));
+			start = now();
+			for (n = 0; n < lookups; n++)
+				sum += kernel->search(map, count, targets[n % TARGETS]);
+			printf(" %10.2f", (now() - start) / lookups);
+		}
+		printf("\n");
+	}
+	return !sum; // keep the lookups live
+}